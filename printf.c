@@ -1,16 +1,26 @@
-// There should be a 1:1 match with specifiers handled by printf1arg()
+// Specifiers are registered at run time by specinit() and fmtregister()
+
+// All conversions of printf(3) which must never reach it from a format, even once unregistered
 #define PRINTF_SPECIFIERS_STD	"diufFeEgGxXosScCaA"
-// This adds specifiers valid for printf(1) but not valid for printf(3)
-#define PRINTF_SPECIFIERS	PRINTF_SPECIFIERS_STD "bQ"
 
-// Include all specifiers valid for printf(3) but not in STD_PRINTF_SPECIFIERS
-#define PRINTF_SPECIFIERS_INVALID "npDOUv" //"bkmrwyBHIJKLMNOPQRTUVWYZ"
+// Include all specifiers valid for printf(3) but never registered
+#define PRINTF_SPECIFIERS_INVALID "npDOv" //"bkmrwyBHIJKLMNOPQRTUVWYZ"
+
+// Include all length modifiers recognized by printf(3) except "q" which is a specifier for printf(1)
+#define PRINTF_LENGTHS "hlLjtz"
 
-// Include all length modifiers recognized by printf(3)
-#define PRINTF_LENGTHS "hlLjtzq"
+
+// Strict ISO C (e.g. -std=c99) hides POSIX interfaces such as fileno(3) unless they are requested
+#if defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _POSIX_C_SOURCE	200809L
+#define _DEFAULT_SOURCE	// MAP_ANONYMOUS with glibc
+#define _BSD_SOURCE	// MAP_ANONYMOUS with older glibc and the BSDs
+#define _DARWIN_C_SOURCE
+#endif // __STRICT_ANSI__
 
 
 #include "cstandards.h"
+#include "printf.h"
 
 #if defined(__has_include) && __has_include(<iconv.h>) && !defined(NO_ICONV)
 #define HAVE_ICONV
@@ -45,12 +55,38 @@
 #include <wchar.h>
 #include <limits.h>
 #include <locale.h>
+#include <time.h>
 #if defined(__has_include) && __has_include(<unistd.h>) && HAVE_PLEDGE
 #include <unistd.h>
 #endif // HAVE_PLEDGE
 #if defined(__has_include) && __has_include(<sysexits.h>)
 #include <sysexits.h>
 #endif // has_sysexits
+#if defined(__has_include) && __has_include(<sys/mman.h>) && __has_include(<sys/stat.h>) && __has_include(<fcntl.h>) && __has_include(<unistd.h>)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS	MAP_ANON
+#endif // MAP_ANON
+#endif // HAVE_MMAP
+#if defined(HAVE_MMAP) && defined(__linux__) && __has_include(<sys/sendfile.h>)
+#define HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif // HAVE_SENDFILE
+#if defined(__has_include) && __has_include(<unistd.h>)
+#include <unistd.h>
+// _POSIX_C_SOURCE is only what the program requests so test what the system actually provides
+#if ( defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L ) || ( defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) && __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ >= 101300 )
+#define HAVE_OPEN_MEMSTREAM
+#endif // open_memstream
+#endif // has_unistd
+#if defined(__SSE2__) && defined(__has_include) && __has_include(<emmintrin.h>) && !defined(NO_SIMD)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif // HAVE_SSE2
 
 #ifndef ARG_MAX
 #define ARG_MAX	4096
@@ -62,9 +98,179 @@
 #define EINVAL	EFAULT+1
 #endif // EINVAL
 
+#if C_Year >= 1999
+#define	strtosint	strtoll
+#define strtouint	strtoull
+#define INT_LM	"ll"
+typedef signed long long	snum;
+typedef unsigned long long	unum;
+#else
+#define	strtosint	strtol
+#define strtouint	strtoul
+#define INT_LM		"l"
+typedef signed long	snum;
+typedef unsigned long	unum;
+#endif // strtoXint
+
 
 static int anyerrno;
-static char *progname;
+static int anyabort;
+static int atfiles;
+static int numbase;	// Base of integer arguments, 0 unless known to be decimal (e.g. zero filled by -r)
+static char *progname = "printf";	// Replaced by argv[0] when run as printf(1)
+
+
+/*
+Conversion specifiers are looked up in a registry rather than a fixed set
+so that programs embedding printf(1) (see printf.h) can add their own, e.g.
+to format IP addresses or durations natively, without forking this file.
+Each specifier has an optional parse hook that converts the argument (e.g.
+to a number) and a render hook that outputs the prologue, the converted
+argument and the epilogue.  The built-in specifiers are registered the
+same way by specinit() and can be replaced just like any other.
+*/
+struct specifier {
+	fmthook parse;
+	fmthook render;	// NULL if not registered
+	int noparam;	// A built-in that takes no "%(...)X" parameter
+};
+
+static struct specifier specifiers[UCHAR_MAX+1];
+static char specifierset[UCHAR_MAX+2];	// "%" and each registered specifier for strcspn(3)
+static int specinitialized;
+
+
+// Kinds of diagnostics counted and rate limited separately by diag()
+#define DIAG_NUMERIC	0
+#define DIAG_FORMAT	1
+#define DIAG_ESCAPE	2
+#define DIAG_ENCODING	3
+#define DIAG_FILE	4
+#define DIAG_INTERNAL	5
+#define DIAG_KINDS	6
+
+static char *diagkinds[DIAG_KINDS] = { "numeric", "format", "escape", "encoding", "file", "internal" };
+static unsigned long diagcount[DIAG_KINDS];
+static unsigned long diaglimit;	// 0 -> no limit
+static int diagjson;
+static unsigned long diagrecord;	// Cycle through the format operand currently being output
+static unsigned long diagarg;	// Argument currently being converted (counting from 1) or 0 if none
+static unsigned long diagargbase;	// Arguments consumed by previous cycles
+
+
+// This decodes the UTF-8 sequence at s into cp, returning its length or 1 with cp U+FFFD if s isn't valid UTF-8
+size_t
+utf8next(unsigned long *cp, unsigned char *s) {
+
+	size_t n, i;
+	unsigned long min;
+
+	if ( s[0] >= 0xc2 && s[0] <= 0xdf ) {
+		n = 2; *cp = s[0] & 0x1f; min = 0x80;
+	} else if ( s[0] >= 0xe0 && s[0] <= 0xef ) {
+		n = 3; *cp = s[0] & 0x0f; min = 0x800;
+	} else if ( s[0] >= 0xf0 && s[0] <= 0xf4 ) {
+		n = 4; *cp = s[0] & 0x07; min = 0x10000;
+	} else {
+		*cp = 0xfffd;
+		return 1;
+	}
+
+	for ( i = 1; i < n; i++ ) {
+		if ( ( s[i] & 0xc0 ) != 0x80 ) { // Also stops at the terminating null
+			*cp = 0xfffd;
+			return 1;
+		}
+		*cp = (*cp << 6) | ( s[i] & 0x3f );
+	}
+
+	// Overlong forms, UTF-16 surrogates and beyond U+10FFFF aren't valid either
+	if ( *cp < min || ( *cp >= 0xd800 && *cp <= 0xdfff ) || *cp > 0x10ffff ) {
+		*cp = 0xfffd;
+		return 1;
+	}
+
+	return n;
+}
+
+
+/*
+All diagnostics go through here rather than straight to stderr so that
+they can be tagged with the record and argument being processed, output
+as JSON lines (-j) and limited to so many of each kind (-l) with a count
+of the rest in diagsummary() at the end.  Since stderr is fully buffered
+by main(), high volumes of diagnostics don't each cost a write(2).
+
+Only the diagnostic is output here -- callers set anyerrno as before.
+*/
+void
+diag(int kind, char *fmt, ...) {
+
+	va_list ap;
+	char msg[1024];
+	char *c;
+	unsigned long cp;
+
+	diagcount[kind]++;
+	if ( diaglimit > 0 && diagcount[kind] > diaglimit )
+		return;
+
+	va_start(ap,fmt);
+	vsnprintf(msg,sizeof(msg),fmt,ap);
+	va_end(ap);
+
+	if ( diagjson ) {
+		fprintf(stderr,"{\"kind\":\"%s\"",diagkinds[kind]);
+		if ( diagrecord > 0 )
+			fprintf(stderr,",\"record\":%lu",diagrecord);
+		if ( diagarg > 0 )
+			fprintf(stderr,",\"argument\":%lu",diagarg);
+		fputs(",\"message\":\"",stderr);
+		for ( c = msg; c[0] != '\0'; c++ )
+			if ( c[0] == '"' || c[0] == '\\' )
+				fprintf(stderr,"\\%c",c[0]);
+			else if ( (unsigned char) c[0] < 0x20 || (unsigned char) c[0] == 0x7f )
+				fprintf(stderr,"\\u%04x",(unsigned int) (unsigned char) c[0]);
+			else if ( (unsigned char) c[0] < 0x80 )
+				fputc(c[0],stderr);
+			else {
+				// Non-ASCII, e.g. from arguments, is escaped so the JSON is valid whatever the bytes are
+				c += utf8next(&cp,(unsigned char *) c) - 1;
+				if ( cp < 0x10000 )
+					fprintf(stderr,"\\u%04lx",cp);
+				else // UTF-16 surrogate pair
+					fprintf(stderr,"\\u%04lx\\u%04lx",0xd800 + ((cp - 0x10000) >> 10),0xdc00 + ((cp - 0x10000) & 0x3ff));
+			}
+		fputs("\"}\n",stderr);
+	} else {
+		fprintf(stderr,"%s: ",progname);
+		if ( diagrecord > 0 )
+			fprintf(stderr,"record %lu: ",diagrecord);
+		if ( diagarg > 0 )
+			fprintf(stderr,"argument %lu: ",diagarg);
+		fprintf(stderr,"%s\n",msg);
+	}
+}
+
+
+// This reports how many of each kind of diagnostic there were when limited with -l or output as JSON lines
+void
+diagsummary(void) {
+
+	int kind;
+
+	if ( diaglimit == 0 && !diagjson )
+		return;
+
+	for ( kind = 0; kind < DIAG_KINDS; kind++ )
+		if ( diagcount[kind] > 0 ) {
+			if ( diagjson )
+				fprintf(stderr,"{\"kind\":\"%s\",\"summary\":true,\"count\":%lu,\"suppressed\":%lu}\n",diagkinds[kind],diagcount[kind],
+					( diaglimit > 0 && diagcount[kind] > diaglimit ) ? diagcount[kind] - diaglimit : 0);
+			else if ( diaglimit > 0 && diagcount[kind] > diaglimit )
+				fprintf(stderr,"%s: %lu %s errors (%lu not shown)\n",progname,diagcount[kind],diagkinds[kind],diagcount[kind] - diaglimit);
+		}
+}
 
 
 /*
@@ -84,12 +290,12 @@ compiler will error if treated as a function called with a terminating ;.
 							else\
 								anyerrno = EINVAL;\
 							if ( errno > 0 && errno != EINVAL )\
-								fprintf(stderr,"%s: \"%s\": %s\n",progname,str,strerror(errno));\
+								diag(DIAG_NUMERIC,"\"%s\": %s",str,strerror(errno));\
 							else\
 								if ( endptr == str )\
-									fprintf(stderr,"%s: \"%s\": expected numeric value\n",progname,str);\
+									diag(DIAG_NUMERIC,"\"%s\": expected numeric value",str);\
 								else\
-									fprintf(stderr,"%s: \"%s\": not completely converted\n",progname,str);\
+									diag(DIAG_NUMERIC,"\"%s\": not completely converted",str);\
 						}
 
 
@@ -122,13 +328,13 @@ fromunicode(size_t returnstrlen, char32_t codepoint) {
 	*/
 	if ( ( e = c32rtomb(NULL, U'\0', ps) ) == (size_t) -1 ) {
 		anyerrno = errno;
-		perror(progname);
+		diag(DIAG_ENCODING,"%s",strerror(errno));
 		strcpy(returnstr,"");
 		*returnstrlen = 0;
 	} else
 		if ( ( e = c32rtomb(returnstr,codepoint,&state) ) == (size_t) -1 ) {
 			anyerrno = errno;
-			perror(progname);
+			diag(DIAG_ENCODING,"%s",strerror(errno));
 			strcpy(returnstr,"");
 			*returnstrlen = 0;
 		} else {
@@ -154,7 +360,7 @@ fromunicode(size_t *returnstrlen, wchar_t codepoint) {
 	if ( codepoint > 0x10FFFF || ( codepoint >= 0xD800 && codepoint < 0xE000 ) ) {
 		errno = EILSEQ;
 		anyerrno = errno;
-		perror(progname);
+		diag(DIAG_ENCODING,"%s",strerror(errno));
 		strcpy(returnstr,"");
 
 		*returnstrlen = 0;
@@ -171,7 +377,7 @@ fromunicode(size_t *returnstrlen, wchar_t codepoint) {
 	*/
 	if ( ( e = wctomb(returnstr,codepoint) ) == (size_t) -1 ) {
 		anyerrno = errno;
-		perror(progname);
+		diag(DIAG_ENCODING,"%s",strerror(errno));
 		strcpy(returnstr,"");
 		*returnstrlen = 0;
 	} else {
@@ -207,7 +413,7 @@ fromunicode(size_t *returnstrlen, uint32_t codepoint) {
 	if ( codepoint > 0x10FFFF || ( codepoint >= 0xD800 && codepoint < 0xE000 ) ) {
 		errno = EILSEQ;
 		anyerrno = errno;
-		perror(progname);
+		diag(DIAG_ENCODING,"%s",strerror(errno));
 		strcpy(returnstr,"");
 
 		*returnstrlen = 0;
@@ -216,7 +422,7 @@ fromunicode(size_t *returnstrlen, uint32_t codepoint) {
 
 	if ( ( cd = iconv_open(ICONV_CURRENT_CODESET,ICONV_UCS_4_INTERNAL) ) == (iconv_t) -1 ) {
 		anyerrno = errno;
-		perror(progname);
+		diag(DIAG_ENCODING,"%s",strerror(errno));
 		strcpy(returnstr,"");
 
 		*returnstrlen = 0;
@@ -224,12 +430,12 @@ fromunicode(size_t *returnstrlen, uint32_t codepoint) {
 	} else
 		if ( ( e = iconv(cd,NULL,NULL,NULL,NULL) ) == (size_t) -1 ) {
 			anyerrno = errno;
-			perror(progname);
+			diag(DIAG_ENCODING,"%s",strerror(errno));
 			strcpy(returnstr,"");
 		} else
 			if ( ( e = iconv(cd,&inbuf,&inbytesleft,&outbuf,&outbytesleft) ) == (size_t) -1 ) {
 				anyerrno = errno;
-				perror(progname);
+				diag(DIAG_ENCODING,"%s",strerror(errno));
 				strcpy(returnstr,"");
 			} else
 				outbuf[0] = '\0';
@@ -245,8 +451,8 @@ fromunicode(size_t *returnstrlen, uint32_t codepoint) {
 char *
 unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 
-	// srcstrlen == -1 -> strlen(srcstr) is unknown
-	int maxstrlen = (((srcstrlen) == (-1)) ? (ARG_MAX) : (srcstrlen + 1));
+	// srcstrlen == -1 -> strlen(srcstr) is unknown otherwise srcstr need not be null terminated
+	size_t maxstrlen = (((srcstrlen) == (size_t) (-1)) ? (strlen(srcstr) + 1) : (srcstrlen + 1));
 	/*
 	This assumes the resulting unescaped string won't be longer than
 	the source string.  This should always be true if
@@ -255,6 +461,7 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 	*/
 	char *returnstr = malloc(maxstrlen * sizeof(char));
 	char c[8+1];
+	size_t clen;
 	char *endptr;
 	size_t ulen; char *u;
 	size_t seglen;
@@ -263,18 +470,25 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 	size_t j = 0;
 	int d = 0;
 
-	while ( d >= 0 && srcstr[i] != '\0' ) {
+	srcstrlen = maxstrlen - 1;
+
+	while ( d >= 0 && i < srcstrlen ) {
 		if ( (maxstrlen-j) > 0 ) {
-			seglen = 0;
-        	        d = sscanf(&srcstr[i],"%[^\\]%zn",&returnstr[j],&seglen);
+			// Copy everything up to the next backslash as is
+			seglen = srcstrlen - i;
+			if ( ( endptr = memchr(&srcstr[i],'\\',seglen) ) != NULL )
+				seglen = endptr - &srcstr[i];
+			memcpy(&returnstr[j],&srcstr[i],seglen);
 			i += seglen; j += seglen;
-			if ( srcstr[i] == '\\' ) {
+			if ( i < srcstrlen ) { // srcstr[i] == '\\'
 				i++;
-				if ( srcstr[i] == 'c' && abortext != NULL ) {
+				if ( i < srcstrlen && srcstr[i] == 'c' && abortext != NULL ) {
 					*abortext = 1;
 					break;
 				} else {
-					switch (srcstr[i]) {
+					// Escape sequences may not extend past srcstrlen
+					clen = srcstrlen - i;
+					switch (( i < srcstrlen ) ? srcstr[i] : '\0') {
 						case '\\': returnstr[j] = '\\'; break;
 						case '\'': returnstr[j] = '\''; break;
 						case 'a': returnstr[j] = '\a'; break;
@@ -286,7 +500,9 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 						case 'v': returnstr[j] = '\v'; break;
 						case 'u':
 #ifdef HAVE_FROMUNICODE
-							strncpy(c,&srcstr[i+1],4); c[4]='\0';										u = fromunicode(&ulen,strtocodepoint(c,&endptr,16));
+							clen = ( clen-1 < 4 ) ? clen-1 : 4;
+							memcpy(c,&srcstr[i+1],clen); c[clen]='\0';
+							u = fromunicode(&ulen,strtocodepoint(c,&endptr,16));
 							i += (endptr-c);
 							if ( (j + ulen) < maxstrlen ) {
 								strncpy(&returnstr[j],u,ulen);
@@ -297,33 +513,34 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 							free(u);
 #else
 							anyerrno = EINVAL;
-							fprintf(stderr,"%s: Unicode escape sequence not supported\n",progname);
+							diag(DIAG_ESCAPE,"Unicode escape sequence not supported");
 #endif // HAVE_FROMUNICODE
 							break;
 						case 'U':
 #ifdef HAVE_FROMUNICODE
-							strncpy(c,&srcstr[i+1],8); c[8]='\0';
+							clen = ( clen-1 < 8 ) ? clen-1 : 8;
+							memcpy(c,&srcstr[i+1],clen); c[clen]='\0';
 							u = fromunicode(&ulen,strtocodepoint(c,&endptr,16));
 							i += (endptr-c);
 							if ( (j + ulen) < maxstrlen ) {
 								strncpy(&returnstr[j],u,ulen);
 								j += ulen - 1; 
 							} else
-								j = maxstrlen;
+								d = -1;
 
 							free(u);
 #else
 							anyerrno = EINVAL;
-							fprintf(stderr,"%s: Unicode escape sequence not supported\n",progname);
+							diag(DIAG_ESCAPE,"Unicode escape sequence not supported");
 #endif // HAVE_FROMUNICODE
 							break;
 						case '0': case '1': case '2': case '3':
 						case '4': case '5': case '6': case '7':
-							if ( srcstr[i] == '0' ) {
-								strncpy(c,&srcstr[i],4); c[4]='\0';
-							} else {
-								strncpy(c,&srcstr[i],3); c[3]='\0';
-							}
+							if ( srcstr[i] == '0' )
+								clen = ( clen < 4 ) ? clen : 4;
+							else
+								clen = ( clen < 3 ) ? clen : 3;
+							memcpy(c,&srcstr[i],clen); c[clen]='\0';
 							returnstr[j] = strtoul(c,&endptr,8);
 							i += (endptr-1-c);
 							break;
@@ -332,7 +549,8 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 							// Fall through to unrecognized (i.e. default) since trailing Backslash is also an error
 						default:
                                				anyerrno = EINVAL;
-                                			fprintf(stderr,"%s: Unrecognized escape sequence \"\\%.*s\" truncated\n",progname,1,&srcstr[i]);
+                                			diag(DIAG_ESCAPE,"Unrecognized escape sequence \"\\%.*s\" truncated",1,&srcstr[i]);
+							d = -1; j--; // Truncate here with -1 to offset j++ below
 							break;
 					}
 					j++; i++;
@@ -341,7 +559,7 @@ unescape(size_t *returnstrlen, size_t srcstrlen, char *srcstr, int *abortext ) {
 		} else {
 			d = -1;
 			anyerrno = EFAULT;
-			fprintf(stderr,"%s: Internal error processing \"%s\"\n",progname,srcstr);
+			diag(DIAG_INTERNAL,"Internal error processing \"%.*s\"",(int) srcstrlen,srcstr);
 		}
 	}
 
@@ -357,18 +575,22 @@ int
 sanitize1fmt(size_t fmtlen, char *fmt, size_t specifierlen, char *specifier) {
 
 	char *c;
+	char *d;
 
 	// Could also use fmt[strcspn(fmt,ETC)] = '\0' here if we wanted to avoid string pointers
-	if ( ( c = strpbrk(fmt,"*$%\\" PRINTF_SPECIFIERS_INVALID PRINTF_SPECIFIERS) ) != NULL ) {
+	c = strpbrk(fmt,"*$%\\" PRINTF_SPECIFIERS_INVALID PRINTF_SPECIFIERS_STD);
+	if ( ( d = strpbrk(fmt,specifierset) ) != NULL && ( c == NULL || d < c ) )
+		c = d;
+	if ( c != NULL ) {
 		anyerrno = EINVAL;
-		fprintf(stderr,"%s: Illegal format \"%%%s%s\" truncated to \"%%%.*s%s\"\n",progname,fmt,specifier,(int) (c-fmt),fmt,specifier);
+		diag(DIAG_FORMAT,"Illegal format \"%%%s%s\" truncated to \"%%%.*s%s\"",fmt,specifier,(int) (c-fmt),fmt,specifier);
 		c[0] = '\0';
 		fmtlen = (c-fmt);
 	}
 
 	if ( ( c = strpbrk(fmt,PRINTF_LENGTHS) ) != NULL ) {
 		anyerrno= EINVAL;
-		fprintf(stderr,"%s: Formats may not include [%s] and \"%%%s%s\" truncated to \"%%%.*s%s\"\n",progname,PRINTF_LENGTHS,fmt,specifier,(int) (c-fmt),fmt,specifier);
+		diag(DIAG_FORMAT,"Formats may not include [%s] and \"%%%s%s\" truncated to \"%%%.*s%s\"",PRINTF_LENGTHS,fmt,specifier,(int) (c-fmt),fmt,specifier);
 		c[0] = '\0';
 		fmtlen = (c-fmt);
 	}
@@ -400,477 +622,2325 @@ prep1fmt(size_t *returnlen,
 }
 
 
-int
-printf1arg(size_t prologuelen, char *prologue,
-	size_t fmtlen, char *fmt,
-	size_t specifierlen, char *specifier,
-	size_t epiloguelen, char *epilogue, char *arg) {
+/*
+This formats arg for the d, i, u, f or F specifiers directly from its
+decimal digits when arg is already a plain decimal number (e.g. "-42" or
+"3.14159" but not "0x2A", "1e3" or "052") rather than converting it to
+binary and back with printf(3).  Beyond saving the conversions, integers
+of any size are output exactly and precision is rounded on the decimal
+digits given (half to even) rather than on their nearest binary value.
+NULL is returned for anything else so the caller can fall back to
+printf(3), including formats with the "#" flag.
+*/
+char *
+decimal1arg(size_t *returnstrlen, size_t fmtlen, char *fmt, char specifier, char *arg) {
+
+	int isfloat = ( specifier == 'f' || specifier == 'F' );
+	int left = 0, plus = 0, space = 0, zero = 0;
+	size_t width = 0;
+	size_t prec = 0;
+	int hasprec = 0;
+	char sign = '\0';
+	char *intpart, *fracpart;
+	size_t intlen, fraclen;
+	size_t i, j, len, pad, digits;
+	int roundup = 0;
+	char *returnstr;
+
+	for ( i = 0; i < fmtlen && strchr("-+ 0#",fmt[i]) != NULL; i++ )
+		switch (fmt[i]) {
+		case '-': left = 1; break;
+		case '+': plus = 1; break;
+		case ' ': space = 1; break;
+		case '0': zero = 1; break;
+		default: return NULL; // "#" alternate forms are left to printf(3)
+		}
+	for ( ; i < fmtlen && fmt[i] >= '0' && fmt[i] <= '9'; i++ )
+		width = 10 * width + (fmt[i] - '0');
+	if ( i < fmtlen && fmt[i] == '.' )
+		for ( hasprec = 1, i++; i < fmtlen && fmt[i] >= '0' && fmt[i] <= '9'; i++ )
+			prec = 10 * prec + (fmt[i] - '0');
+	if ( i < fmtlen && fmt[i] != '\0' )
+		return NULL;
+
+	// The digits are output as given so the radix character must be the one printf(3) would output
+	if ( isfloat && strcmp(localeconv()->decimal_point,".") != 0 )
+		return NULL;
+
+	if ( arg[0] == '-' || arg[0] == '+' )
+		sign = *arg++;
+	if ( sign == '-' && specifier == 'u' )
+		return NULL; // Wraps around in strtoul(3)
+
+	intpart = arg;
+	intlen = strspn(intpart,"0123456789");
+	if ( isfloat && intpart[intlen] == '.' ) {
+		fracpart = &intpart[intlen+1];
+		fraclen = strspn(fracpart,"0123456789");
+	} else {
+		fracpart = &intpart[intlen];
+		fraclen = 0;
+	}
+	if ( fracpart[fraclen] != '\0' || intlen + fraclen == 0 )
+		return NULL;
+	// Leading zeros make an integer octal for strtol(3)
+	if ( !isfloat && intlen > 1 && intpart[0] == '0' )
+		return NULL;
+
+	while ( intlen > 1 && intpart[0] == '0' ) {
+		intpart++; intlen--;
+	}
+	if ( !isfloat && intpart[0] == '0' && sign == '-' )
+		sign = '\0'; // No negative zero for integers
+
+	if ( specifier == 'u' )
+		sign = '\0'; // Like printf(3), "+" and " " only apply to signed conversions
+	else if ( sign != '-' )
+		sign = plus ? '+' : ( space ? ' ' : '\0' );
+
+	if ( isfloat ) {
+		if ( !hasprec )
+			prec = 6;
+		if ( fraclen > prec ) {
+			if ( fracpart[prec] > '5' || ( fracpart[prec] == '5' && strspn(&fracpart[prec+1],"0") < fraclen-prec-1 ) )
+				roundup = 1;
+			else if ( fracpart[prec] == '5' ) // Exactly half way so round to even
+				roundup = ( ( ( prec > 0 ) ? fracpart[prec-1] : ( intlen > 0 ? intpart[intlen-1] : '0' ) ) - '0' ) % 2;
+		}
+		digits = ( intlen > 0 ? intlen : 1 ) + ( prec > 0 ? 1 + prec : 0 );
+	} else {
+		if ( hasprec )
+			zero = 0;
+		if ( intlen == 1 && intpart[0] == '0' && hasprec && prec == 0 )
+			intlen = 0; // Zero with zero precision is no digits at all
+		digits = ( prec > intlen ) ? prec : intlen;
+	}
 
-	int abort = 0;
+	len = digits + ( sign != '\0' ) + 1; // + 1 in case rounding up adds a digit
+	if ( width > len )
+		len = width;
+	returnstr = malloc((len+1) * sizeof(char));
 
-	size_t uprologuelen; char *uprologue;
-	size_t ufmtlen; char *ufmt;
-	size_t uepiloguelen; char *uepilogue;
-	size_t uarglen; char *uarg;
+	// Render the digits right aligned, i.e. before knowing whether rounding adds one
+	j = len;
+	returnstr[j] = '\0';
+	if ( isfloat ) {
+		for ( i = prec; i > 0; i-- )
+			returnstr[--j] = ( i-1 < fraclen ) ? fracpart[i-1] : '0';
+		if ( prec > 0 )
+			returnstr[--j] = '.';
+		if ( intlen == 0 )
+			returnstr[--j] = '0';
+		for ( i = intlen; i > 0; i-- )
+			returnstr[--j] = intpart[i-1];
+
+		for ( i = len; roundup && i > j; i-- )
+			if ( returnstr[i-1] == '9' )
+				returnstr[i-1] = '0';
+			else if ( returnstr[i-1] != '.' ) {
+				returnstr[i-1]++;
+				roundup = 0;
+			}
+		if ( roundup )
+			returnstr[--j] = '1';
+	} else {
+		for ( i = intlen; i > 0; i-- )
+			returnstr[--j] = intpart[i-1];
+		for ( i = intlen; i < prec; i++ )
+			returnstr[--j] = '0';
+	}
 
-#if C_Year >= 1999 
-#define	strtosint	strtoll
-#define strtouint	strtoull
-#define INT_LM	"ll"
-	signed long long slli;
-	unsigned long long ulli;
-#else
-#define	strtosint	strtol
-#define strtouint	strtoul
-#define INT_LM		"l"
-	signed long slli;
-	unsigned long ulli;
-#endif // strtoXint
-	double d;
+	digits = len - j;
+	pad = ( width > digits + ( sign != '\0' ) ) ? width - digits - ( sign != '\0' ) : 0;
+	if ( left ) {
+		// Shift to the front and pad with spaces on the right
+		i = 0;
+		if ( sign != '\0' )
+			returnstr[i++] = sign;
+		memmove(&returnstr[i],&returnstr[j],digits);
+		i += digits;
+		memset(&returnstr[i],' ',pad);
+		i += pad;
+		returnstr[i] = '\0';
+	} else {
+		if ( zero ) {
+			memset(&returnstr[j-pad],'0',pad);
+			j -= pad;
+		}
+		if ( sign != '\0' )
+			returnstr[--j] = sign;
+		if ( !zero ) {
+			memset(&returnstr[j-pad],' ',pad);
+			j -= pad;
+		}
+		memmove(returnstr,&returnstr[j],len - j + 1);
+		i = len - j;
+	}
+
+	*returnstrlen = i;
+	return returnstr;
+}
+
+
+/*
+This packs arg into the raw bytes of a fixed-width integer (w and W
+specifiers) or IEEE float (r and R specifiers), little-endian for the lower
+case specifier and big-endian for the upper case.  The width of the
+conversion specification is the number of bytes: 1, 2, 4 or 8 for integers
+(default 4) and 4 or 8 for floats (default 8).
+*/
+size_t
+pack1arg(unsigned char *bytes, size_t fmtlen, char *fmt, char specifier, char *arg) {
 
+	size_t n;
+	size_t i;
+	unsigned char c;
+	unsigned int one = 1;
+	int bigendian = ( specifier == 'W' || specifier == 'R' );
+	int hostbigendian = ( ((unsigned char *) &one)[0] == 0 );
 	char *endptr;
+	snum slli;
+	unum ulli;
+	double d;
+	float f;
 
-	if ( prologuelen > 0 )
-		uprologue = unescape(&uprologuelen,prologuelen,prologue,NULL);
-	else
-		uprologue = "";
-	if ( epiloguelen > 0 )
-		uepilogue = unescape(&uepiloguelen,epiloguelen,epilogue,NULL);
-	else
-		uepilogue = "";
+	n = strtoul(&fmt[strspn(fmt,"-+ #0")],NULL,10);
 
-	// Just print the text if no formats in this batch
-	if ( specifierlen == 0 && fmtlen == 0 )
-		// printf("%s",X) is multiple times faster than printf(X)
-		printf("%s%s",uprologue,uepilogue);
-	else if ( specifierlen == 0 && strcmp(fmt,"%" ) == 0 ) // "Format" of this batch was a "%%"
-		printf("%s%%%s",uprologue,uepilogue);
-	else {
-		// Sanitize fmt for anything that would throw off call printf(3) such as causing it to read an extra argument
-		fmtlen = sanitize1fmt(fmtlen,fmt,specifierlen,specifier);
-		
-		ufmtlen = 0;
-
-		switch(specifier[0]) {
-		case 'd':
-		case 'i':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(INT_LM),INT_LM,specifierlen,specifier);
-
-			if ( arg != NULL )
-				if ( arg[0] == '\'' || arg[0] == '"' ) {
-					wchar_t *warg = malloc(2 * sizeof(wchar_t)); // arg[0] + arg[1] but no null
-
-					if ( ( mbstowcs(warg,arg,2) ) == (size_t) -1 ) {
-						anyerrno = errno;
-						perror("printf format conversion");
-						slli = 0;
-					} else
-						slli = warg[1];
-
-					free(warg);
-				} else { // This is intentionally a macro-generated codeblock not a function
-					strtonum(slli,strtosint(arg,&endptr,0),arg,endptr)
-				}
-			else
-				slli = 0;
+	if ( specifier == 'w' || specifier == 'W' ) {
+		if ( n == 0 )
+			n = 4;
+		if ( n != 1 && n != 2 && n != 4 && n != 8 ) {
+			anyerrno = EINVAL;
+			diag(DIAG_FORMAT,"Illegal width %lu for \"%%%s%c\" changed to 4",(unsigned long) n,fmt,specifier);
+			n = 4;
+		}
 
-			printf(ufmt,uprologue,slli,uepilogue);
+		if ( arg == NULL )
+			ulli = 0;
+		else if ( arg[0] == '-' ) { // This is intentionally a macro-generated codeblock not a function
+			strtonum(slli,strtosint(arg,&endptr,numbase),arg,endptr)
+			ulli = (unum) slli;
+			if ( n < sizeof(unum) && slli < -((snum) 1 << (8*n-1)) ) {
+				anyerrno = ERANGE;
+				diag(DIAG_NUMERIC,"\"%s\": %s",arg,strerror(ERANGE));
+			}
+		} else {
+			strtonum(ulli,strtouint(arg,&endptr,numbase),arg,endptr)
+			if ( n < sizeof(unum) && ulli >> (8*n) != 0 ) {
+				anyerrno = ERANGE;
+				diag(DIAG_NUMERIC,"\"%s\": %s",arg,strerror(ERANGE));
+			}
+		}
 
-			break;
-		case 'x':
-		case 'X':
-		case 'o':
-		case 'u':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(INT_LM),INT_LM,specifierlen,specifier);
-
-			if ( arg != NULL )
-				if ( arg[0] == '\'' || arg[0] == '"' ) {
-					wchar_t *warg = malloc(2 * sizeof(wchar_t)); // arg[0] + arg[1] + but no null
-
-					if ( ( mbstowcs(warg,arg,2) ) == (size_t) -1 ) {
-						anyerrno = errno;
-						perror("printf format conversion");
-						ulli = 0;
-					} else
-						ulli = warg[1];
-
-					free(warg);
-				} else { // This is intentionally a macro-generated codeblock not a function
-					strtonum(ulli,strtouint(arg,&endptr,0),arg,endptr)
-				}
+		// Shifting rather than copying the bytes of ulli makes this independent of the host's byte order
+		for ( i = 0; i < n; i++ ) {
+			if ( i < sizeof(unum) )
+				c = (ulli >> (8*i)) & 0xff;
 			else
-				ulli = 0;
+				c = ( arg != NULL && arg[0] == '-' ) ? 0xff : 0;
+			bytes[bigendian ? n-1-i : i] = c;
+		}
+	} else {
+		if ( n == 0 )
+			n = sizeof(double);
+		if ( n != sizeof(float) && n != sizeof(double) ) {
+			anyerrno = EINVAL;
+			diag(DIAG_FORMAT,"Illegal width %lu for \"%%%s%c\" changed to %lu",(unsigned long) n,fmt,specifier,(unsigned long) sizeof(double));
+			n = sizeof(double);
+		}
 
-			printf(ufmt,uprologue,ulli,uepilogue);
+		if ( arg != NULL ) { // This is intentionally a macro-generated codeblock not a function
+			strtonum(d,strtod(arg,&endptr),arg,endptr)
+		} else
+			d = 0.0;
 
-			break;
-		case 'f':
-		case 'F':
-		case 'e':
-		case 'E':
-		case 'g':
-		case 'G':
-		case 'a':
-		case 'A':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",specifierlen,specifier);
-
-			if ( arg != NULL ) { // This is intentionally a macro-generated codeblock not a function
-				strtonum(d,strtod(arg,&endptr),arg,endptr)
-			} else
-				d = 0.0;
+		if ( n == sizeof(float) ) {
+			f = (float) d;
+			memcpy(bytes,&f,n);
+		} else
+			memcpy(bytes,&d,n);
+
+		// Assumes floats are stored in the same byte order as integers
+		if ( bigendian != hostbigendian )
+			for ( i = 0; i < n/2; i++ ) {
+				c = bytes[i];
+				bytes[i] = bytes[n-1-i];
+				bytes[n-1-i] = c;
+			}
+	}
 
-			printf(ufmt,uprologue,d,uepilogue);
+	return n;
+}
 
-			break;
-		case 's':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",specifierlen,specifier);
 
-			if ( arg != NULL )
-				printf(ufmt,uprologue,arg,uepilogue);
-			else
-				printf(ufmt,uprologue,"",uepilogue);
+// Bytes needing an escape sequence in a JSON string
+#define ESCAPE_JSON	"\"\\\001\002\003\004\005\006\007\010\011\012\013\014\015\016\017" \
+			"\020\021\022\023\024\025\026\027\030\031\032\033\034\035\036\037"
+// Bytes requiring a CSV field to be quoted
+#define ESCAPE_CSV	"\",\r\n"
+// Bytes requiring a shell word to be quoted
+#define ESCAPE_SHELL	" \t\r\n!\"#$&'()*;<>?[\\]^`{|}~"
 
-			break;
-		case 'S':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",specifierlen,specifier);
-
-			if ( arg != NULL ) {
-				wchar_t *wfmt;
-				size_t nwfmt;
-				wchar_t *warg;
-				size_t nwarg;
-
-				wfmt = malloc((ufmtlen+1) * sizeof(wchar_t)); // Assume wcslen(wfmt) <= strlen(ufmt) && strlen(ufmt) <= ufmtlen
-				if ( ( nwfmt = mbstowcs(wfmt,ufmt,ufmtlen+1) ) == (size_t) -1 ) {
-					anyerrno = errno;
-					perror("printf format conversion");
-				} else {
-					warg = malloc(ARG_MAX * sizeof(wchar_t));
-					if ( ( nwarg = mbstowcs(warg,arg,ARG_MAX) ) == (size_t) -1 ) {
-						anyerrno = errno;
-						perror("printf argument conversion");
-					} else
-						wprintf(wfmt,uprologue,warg,uepilogue);
-
-					free(warg);
-				}
 
-				free(wfmt);
-			} else
-				printf(ufmt,uprologue,L"",uepilogue);
+/*
+This returns the length of the run of bytes at the start of arg (no more
+than arglen) that don't need escaping.  With SSE2, the JSON and CSV sets
+(and the lone single quote that is special once inside a shell word) are
+tested 16 bytes at a time with the remainder, as well as the larger set
+of bytes that make a shell word need quotes, left to strcspn(3).
+*/
+size_t
+escapespan(size_t arglen, char *arg, char *reject, char specifier, int quoted) {
 
-			break;
-		case 'b':
-			// %b -> %s for call to printf(3)
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",strlen("s"),"s");
+	size_t i = 0;
+#ifdef HAVE_SSE2
+	__m128i v, m;
+	int bits;
+
+	if ( specifier != 'q' || quoted ) {
+		__m128i dquote = _mm_set1_epi8('"');
+		__m128i backslash = _mm_set1_epi8('\\');
+		__m128i control = _mm_set1_epi8(0x1f);
+		__m128i comma = _mm_set1_epi8(',');
+		__m128i cr = _mm_set1_epi8('\r');
+		__m128i lf = _mm_set1_epi8('\n');
+		__m128i squote = _mm_set1_epi8('\'');
+
+		for ( ; i + 16 <= arglen; i += 16 ) {
+			v = _mm_loadu_si128((__m128i *) &arg[i]);
+			switch (specifier) {
+			case 'J':
+				// Bytes up to 0x1f are those unchanged by an unsigned min with 0x1f
+				m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,dquote),_mm_cmpeq_epi8(v,backslash)),
+					_mm_cmpeq_epi8(_mm_min_epu8(v,control),v));
+				break;
+			case 'V':
+				m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,dquote),_mm_cmpeq_epi8(v,comma)),
+					_mm_or_si128(_mm_cmpeq_epi8(v,cr),_mm_cmpeq_epi8(v,lf)));
+				break;
+			default:
+				m = _mm_cmpeq_epi8(v,squote);
+				break;
+			}
+			if ( ( bits = _mm_movemask_epi8(m) ) != 0 ) {
+				for ( ; ( bits & 1 ) == 0; bits >>= 1 )
+					i++;
+				return i;
+			}
+		}
+	}
+#else
+	(void) specifier; (void) quoted;
+#endif // HAVE_SSE2
 
-			if ( arg != NULL ) {
-				uarg = unescape(&uarglen,-1,arg,&abort);
+	i += strcspn(&arg[i],reject);
 
-				if ( abort == 0 )
-					printf(ufmt,uprologue,uarg,uepilogue);
-				else
-					printf(ufmt,uprologue,uarg,"");
+	return ( i < arglen ) ? i : arglen;
+}
 
-				free(uarg);
-			} else
-				printf(ufmt,uprologue,"",uepilogue);
 
-			break;
-		case 'Q':
-			// %Q -> %S for call to printf(3)
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",strlen("S"),"S");
-
-			if ( arg != NULL ) {
-				wchar_t *wfmt;
-				size_t nwfmt;
-				wchar_t *warg;
-				size_t nwarg;
-
-				wfmt = malloc((ufmtlen+1) * sizeof(wchar_t)); // Assume wcslen(wfmt) <= strlen(ufmt) && strlen(ufmt) <= ufmtlen
-				if ( ( nwfmt = mbstowcs(wfmt,ufmt,ufmtlen+1) ) == (size_t) -1 ) {
-					anyerrno = errno;
-					perror("printf format conversion");
-				} else {
-					uarg = unescape(&uarglen,-1,arg,&abort);
-					warg = malloc((uarglen+1) * sizeof(wchar_t));
-					if ( ( nwarg = mbstowcs(warg,uarg,uarglen+1) ) == (size_t) -1 ) {
-						anyerrno = errno;
-						perror("printf argument conversion");
-					} else
-						if ( abort == 0 )
-							wprintf(wfmt,uprologue,warg,uepilogue);
-						else
-							wprintf(wfmt,uprologue,warg,L"");
-
-					free(warg);
-					free(uarg);
-				}
+/*
+This quotes the first arglen bytes of arg as a JSON string (J specifier),
+a CSV field (V specifier) or a shell word (q specifier).  Rather than
+testing byte by byte, escapespan() finds the next byte that actually
+needs escaping and the clean run before it is copied in bulk.
+*/
+char *
+escape1arg(size_t *returnstrlen, size_t arglen, char *arg, char specifier) {
 
-				free(wfmt);
-			} else
-				printf(ufmt,uprologue,L"",uepilogue);
+	// Worst case is every byte becoming a 6 byte "\u00XX" JSON escape
+	char *returnstr = malloc((6 * arglen + 3) * sizeof(char));
+	char *reject;
+	size_t seglen;
+	size_t i = 0;
+	size_t j = 0;
 
-			break;
-		case 'c':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",specifierlen,specifier);
+	switch (specifier) {
+	case 'J': reject = ESCAPE_JSON; break;
+	case 'V': reject = ESCAPE_CSV; break;
+	default: reject = ESCAPE_SHELL; break;
+	}
 
-			if ( arg != NULL )
-				printf(ufmt,uprologue,(int) arg[0],uepilogue);
-			else
-				printf(ufmt,uprologue,"",uepilogue);
+	seglen = escapespan(arglen,arg,reject,specifier,0);
+	if ( seglen >= arglen && ( specifier == 'V' || ( specifier == 'q' && arglen > 0 ) ) ) {
+		// Neither CSV nor the shell need quotes around strings without special characters
+		memcpy(returnstr,arg,arglen);
+		returnstr[arglen] = '\0';
+		*returnstrlen = arglen;
+		return returnstr;
+	}
 
+	returnstr[j++] = ( specifier == 'J' || specifier == 'V' ) ? '"' : '\'';
+	while ( i < arglen ) {
+		memcpy(&returnstr[j],&arg[i],seglen);
+		i += seglen; j += seglen;
+		if ( i >= arglen )
 			break;
-		case 'C':
-			ufmt = prep1fmt(&ufmtlen,fmtlen,fmt,strlen(""),"",specifierlen,specifier);
-
-			if ( arg != NULL ) {
-				wchar_t *wfmt;
-				size_t nwfmt;
-				wchar_t warg;
-				size_t nwarg;
-
-				wfmt = malloc((ufmtlen+1) * sizeof(wchar_t)); // Assume wcslen(wfmt) <= strlen(ufmt) && strlen(ufmt) <= ufmtlen
-				if ( ( nwfmt = mbstowcs(wfmt,ufmt,ufmtlen+1) ) == (size_t) -1 ) {
-					anyerrno = errno;
-					perror("printf format conversion");
-				} else
-					if ( ( nwarg = mbtowc(&warg,arg,MB_LEN_MAX) ) == (size_t) -1 ) {
-						anyerrno = errno;
-						perror("printf argument conversion");
-					} else
-						wprintf(wfmt,uprologue,(wint_t) warg,uepilogue);
-
-				free(wfmt);
-			} else
-				printf(ufmt,uprologue,L"",uepilogue);
 
+		switch (specifier) {
+		case 'J':
+			returnstr[j++] = '\\';
+			switch (arg[i]) {
+			case '"': returnstr[j++] = '"'; break;
+			case '\\': returnstr[j++] = '\\'; break;
+			case '\b': returnstr[j++] = 'b'; break;
+			case '\f': returnstr[j++] = 'f'; break;
+			case '\n': returnstr[j++] = 'n'; break;
+			case '\r': returnstr[j++] = 'r'; break;
+			case '\t': returnstr[j++] = 't'; break;
+			default:
+				sprintf(&returnstr[j],"u%04x",(unsigned int) (unsigned char) arg[i]);
+				j += strlen("u0000");
+				break;
+			}
 			break;
-		default: // Should not be reached unless PRINTF_SPECIFIERS contains characters not listed as one of the cases
-			anyerrno = EFAULT;
-			fprintf(stderr,"%s: Internal error with format %s%s\n",progname,fmt,specifier);
-
+		case 'V':
+			if ( arg[i] == '"' )
+				returnstr[j++] = '"';
+			returnstr[j++] = arg[i];
+			break;
+		default:
+			// Within single quotes only a single quote itself is special
+			if ( arg[i] == '\'' ) {
+				memcpy(&returnstr[j],"'\\''",strlen("'\\''"));
+				j += strlen("'\\''");
+			} else
+				returnstr[j++] = arg[i];
 			break;
 		}
+		i++;
 
-		if ( ufmtlen > 0 ) free(ufmt);
+		if ( specifier == 'q' )
+			seglen = escapespan(arglen-i,&arg[i],"'",specifier,1);
+		else
+			seglen = escapespan(arglen-i,&arg[i],reject,specifier,1);
 	}
+	returnstr[j++] = ( specifier == 'J' || specifier == 'V' ) ? '"' : '\'';
+	returnstr[j] = '\0';
 
-	if ( epiloguelen > 0 ) free(uepilogue);
-	if ( prologuelen > 0 ) free(uprologue);
-
-	return abort;
+	*returnstrlen = j;
+	return returnstr;
 }
 
 
-int
-parse1fmt(size_t *returnn1, char *s1,
-	size_t *returnn2, char *s2,
-	size_t *returnn3, char *s3,
-	size_t *returnn4, char *s4,
-	size_t *returnn5, char *s5,
-	size_t fmtlen, char *fmt) {
+#define BASE64_DIGITS	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+#define BASE64URL_DIGITS	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
 
-	size_t n;
-	size_t n1 = 0;
-	size_t n2 = 0;
-	size_t n3 = 0;
-	size_t n4 = 0;
-	size_t n5 = 0;
-	int d;
-	
-	if ( (d = sscanf(fmt,"%[^%]%zn%1[%]%zn%[^%" PRINTF_SPECIFIERS "]%zn%1[" PRINTF_SPECIFIERS "]%zn%[^%]%zn",s1,&n1,s2,&n2,s3,&n3,s4,&n4,s5,&n5)) == 5 ) {
-			n = n5;
-			n5 = n - n4;
-			n4 = n4 - n3;
-			n3 = n3 - n2;
-			n2 = n2 - n1;
-		} else {
-			switch(d) {
-				case 4: // This is ^[^%]+%[^%PRINTF_SPECIFIERS]+[PRINTF_SPECIFIERS](%.*|$)
-					n = n4;
-					n4 = n - n3;
-					n3 = n3 - n2;
-					n2 = n2 - n1;
-					s5[0] = '\0'; n5 = 0;
-					break;
-				case 3: // This is ^[^%]+%[^%PRINTF_SPECIFIERS]+$ -> no final printf specifier -> likely invalid printf format -> similar to case 1 except still need to advance past the format and process any remaining text
-					anyerrno = EINVAL;
-					fprintf(stderr,"%s: Illegal format \"%.*s\" truncated\n",progname,(int) (n3-n1),&fmt[n1]);
-					n = n3;
-					s2[0] = '\0'; n2 = 0;
-					s3[0] = '\0'; n3 = 0;
-					s4[0] = '\0'; n4 = 0;
-					s5[0] = '\0'; n5 = 0;
-					break;
-				case 0: // This is ^%.* -> Either a single remaining %, a %% escape, or a printf format (adjudicated by case 2)
-					s1[0] = '\0'; n1 = 0;
-					strcpy(s2,"%"); n2 = strlen("%");
-					if ( (d = sscanf(&fmt[n2],"%[^%" PRINTF_SPECIFIERS "]%zn%1[" PRINTF_SPECIFIERS "]%zn%[^%]%zn",s3,&n3,s4,&n4,s5,&n5)) > 1 ) {
-						if ( d == 2 ) {
-							n = n2 + n4;
-							s5[0] = '\0'; n5 = 0;
-						} else { // d == 3
-							n = n2 + n5;
-							n5 = n5 - n4;
-						}
-						n4 = n4 - n3;
-						break;
-					} // else d == 0 -> no match
-					// If no match from 2nd sscanf then it's either %% or %[PRINTF_SPECIFIER] or %[INVALID] same as case=2 with no text -> no break and fall through
-				case 2: // ^[^%]+%[% or PRINTF_SPECIFIER] -> text followed by simple [no flags/etc] printf format
-					if ( fmt[n2] == '%' ) {
-						strcpy(s3,"%"); n3 = n2 + strlen("%");
-						n = n3;
-						n3 = n3 - n2;
-						n2 = n2 - n1;
-						s4[0] = '\0'; n4 = 0;
-						s5[0] = '\0'; n5 = 0;
-					} else {
-						s3[0] = '\0'; n3 = 0;
-						if ( (d = sscanf(&fmt[n2],"%1[" PRINTF_SPECIFIERS "]%zn%[^%]%zn",s4,&n4,s5,&n5)) == 2 ) {
-							n = n2 + n5;
-							n5 = n5 - n4;
-						} else {
-							if ( d == 0 ) {
-								anyerrno = EINVAL;
-								if ( fmt[n2] == '\0' )
-									n3 = 0;
-								else
-									n3 = 1;
-								fprintf(stderr,"%s: Illegal format \"%.*s\" truncated to \"%.*s\"\n",progname,(int) (n2 + n3),&fmt[n1],(int) n3,&fmt[n2]);
-								n3 = 0;
-								s4[0]='\0'; n4 = 0;
-							}
-							n = n2 + n4;
-							s5[0] = '\0'; n5 = 0;
-						}
-						n2 = n2 - n1;
-					}
-					break;
-				case 1: // This is ^[^%]+ -> all text no printf format
-					n = n1;
-					s2[0] = '\0'; n2 = 0;
-					s3[0] = '\0'; n3 = 0;
-					s4[0] = '\0'; n4 = 0;
-					s5[0] = '\0'; n5 = 0;
-					break;
-				default: // Should never happen -> internal error
-					anyerrno = EFAULT;
-					fprintf(stderr,"%s: Internal error with format %s\n",progname,fmt);
-					n = strlen(fmt);
-					break;
+
+/*
+This encodes the first arglen bytes of arg as lowercase (y specifier) or
+uppercase (Y specifier) hexadecimal or as padded base64 (B specifier) or
+unpadded base64url (U specifier).  With SSE2, hexadecimal is encoded 16
+bytes at a time with any remainder (or everything without SSE2) encoded
+a byte at a time.  Base64 is encoded 3 bytes at a time from a table.
+*/
+char *
+encode1arg(size_t *returnstrlen, size_t arglen, char *arg, char specifier) {
+
+	char *returnstr = malloc((2 * arglen + 4) * sizeof(char)); // Hex is always longer than base64
+	unsigned char *src = (unsigned char *) arg;
+	char *digits;
+	size_t i = 0;
+	size_t j = 0;
+	unsigned long triplet;
+
+	if ( specifier == 'y' || specifier == 'Y' ) {
+		digits = ( specifier == 'y' ) ? "0123456789abcdef" : "0123456789ABCDEF";
+#ifdef HAVE_SSE2
+		{
+			__m128i mask = _mm_set1_epi8(0x0f);
+			__m128i nine = _mm_set1_epi8(9);
+			__m128i zero = _mm_set1_epi8('0');
+			__m128i alpha = _mm_set1_epi8(digits[10] - '0' - 10);
+			__m128i v, hi, lo;
+
+			for ( ; i + 16 <= arglen; i += 16, j += 32 ) {
+				v = _mm_loadu_si128((__m128i *) &src[i]);
+				hi = _mm_and_si128(_mm_srli_epi16(v,4),mask);
+				lo = _mm_and_si128(v,mask);
+				// Nibble n -> '0' + n, plus the distance from '9'+1 to 'a' (or 'A') when n > 9
+				hi = _mm_add_epi8(_mm_add_epi8(hi,zero),_mm_and_si128(_mm_cmpgt_epi8(hi,nine),alpha));
+				lo = _mm_add_epi8(_mm_add_epi8(lo,zero),_mm_and_si128(_mm_cmpgt_epi8(lo,nine),alpha));
+				_mm_storeu_si128((__m128i *) &returnstr[j],_mm_unpacklo_epi8(hi,lo));
+				_mm_storeu_si128((__m128i *) &returnstr[j+16],_mm_unpackhi_epi8(hi,lo));
 			}
 		}
+#endif // HAVE_SSE2
+		for ( ; i < arglen; i++ ) {
+			returnstr[j++] = digits[src[i] >> 4];
+			returnstr[j++] = digits[src[i] & 0x0f];
+		}
+	} else {
+		digits = ( specifier == 'B' ) ? BASE64_DIGITS : BASE64URL_DIGITS;
+		for ( ; i + 3 <= arglen; i += 3 ) {
+			triplet = ((unsigned long) src[i] << 16) | ((unsigned long) src[i+1] << 8) | src[i+2];
+			returnstr[j++] = digits[(triplet >> 18) & 0x3f];
+			returnstr[j++] = digits[(triplet >> 12) & 0x3f];
+			returnstr[j++] = digits[(triplet >> 6) & 0x3f];
+			returnstr[j++] = digits[triplet & 0x3f];
+		}
+		if ( i < arglen ) {
+			triplet = (unsigned long) src[i] << 16;
+			if ( i + 1 < arglen )
+				triplet |= (unsigned long) src[i+1] << 8;
+			returnstr[j++] = digits[(triplet >> 18) & 0x3f];
+			returnstr[j++] = digits[(triplet >> 12) & 0x3f];
+			if ( i + 1 < arglen )
+				returnstr[j++] = digits[(triplet >> 6) & 0x3f];
+			else if ( specifier == 'B' )
+				returnstr[j++] = '=';
+			if ( specifier == 'B' )
+				returnstr[j++] = '=';
+		}
+	}
+	returnstr[j] = '\0';
 
-	*returnn1 = n1; *returnn2 = n2; *returnn3 = n3; *returnn4 = n4; *returnn5 = n5;
-
-	return n;
+	*returnstrlen = j;
+	return returnstr;
 }
 
 
-int
-fmtpullparams(size_t *n3, char *s3, int numargs, char *args[], int nextarg) {
+#define TIME_PATCHES_MAX	8
+#define TIME_CACHES	4
 
-	char	*c;
-	size_t	fmt_width_i;
-	int	fmt_width_arg;
-	size_t	fmt_width_strlen;
-	size_t	fmt_prec_i;
-	int	fmt_prec_arg;
-	size_t	fmt_prec_strlen;
+/*
+Cached rendering of the format inside "%(...)T" for the most recent
+argument.  Rendering with strftime(3) is split at each "%S" and "%N" so that
+while later arguments fall within the same minute only the digits of those
+fields need patching.  Formats with other fields that change every second
+(e.g. "%s" or "%c") are instead rendered again whenever the second changes.
+*/
+struct timecache {
+	char *fmt;	// Format the rendering is for or NULL if nothing cached
+	int permin;	// Whether the rendering stays valid for the rest of the minute
+	time_t minute;	// Start of the minute the rendering is for
+	time_t second;
+	char *buf;
+	size_t buflen;
+	size_t bufsize;
+	int npatches;
+	size_t patchat[TIME_PATCHES_MAX];
+	int patchdigits[TIME_PATCHES_MAX];	// 0 for "%S" otherwise the number of digits of "%N"
+};
+
+// One per distinct "%(...)T" format in use with the least recently filled replaced first
+static struct timecache timecaches[TIME_CACHES];
+static int nexttimecache;
+
+
+// This appends the strftime(3) rendering of seglen bytes of segfmt to the cached rendering
+void
+timecacheappend(struct timecache *tc, size_t seglen, char *segfmt, struct tm *tm) {
 
-	c = strchr(s3,'*');
-	if ( c != NULL ) {
-		fmt_width_i = (c-s3);
-		fmt_width_arg = nextarg;
-		if ( args[fmt_width_arg] == NULL )
-			fmt_width_strlen=0;
-		else
-			fmt_width_strlen=strlen(args[nextarg]);
-		if ( nextarg < numargs )
-			nextarg++;
+	char *sfmt;
+	size_t n = 0;
+	size_t room;
 
-		c = strstr(&c[1],".*");
-		if ( c != NULL ) {
-			fmt_prec_i = (c-s3);
-			fmt_prec_arg = nextarg;
-			if ( args[fmt_prec_arg] == NULL)
-				fmt_prec_strlen = 0;
-			else
-				fmt_prec_strlen = strlen(args[fmt_prec_arg]);
-			if ( nextarg < numargs )
-				nextarg++;
+	if ( seglen == 0 )
+		return;
 
-			if ( fmt_prec_strlen+fmt_width_strlen < 2 )
-				memmove(&s3[fmt_prec_i+strlen(".*")+fmt_prec_strlen-1+fmt_width_strlen-1],&s3[fmt_prec_i+strlen(".*")],2-fmt_prec_strlen-fmt_width_strlen);
-			else
-				memmove(&s3[fmt_prec_i+strlen(".*")+fmt_prec_strlen-1+fmt_width_strlen-1],&s3[fmt_prec_i+strlen(".*")],fmt_prec_strlen-1+fmt_width_strlen-1);
-			memmove(&s3[fmt_width_i],args[fmt_width_arg],fmt_width_strlen);
-			s3[fmt_width_i+fmt_width_strlen]='.';
-			memmove(&s3[fmt_width_i+fmt_width_strlen+1],args[fmt_prec_arg],fmt_prec_strlen);
-		} else {
-			if ( fmt_width_strlen < 1 )
-				memmove(&s3[fmt_width_i+1+fmt_width_strlen-1],&s3[fmt_width_i+1],1-fmt_width_strlen);
-			else
-				memmove(&s3[fmt_width_i+1+fmt_width_strlen-1],&s3[fmt_width_i+1],fmt_width_strlen-1);
-			memmove(&s3[fmt_width_i],args[fmt_width_arg],fmt_width_strlen);
+	sfmt = malloc((seglen+1) * sizeof(char));
+	memcpy(sfmt,segfmt,seglen); sfmt[seglen] = '\0';
+
+	// strftime(3) returning 0 is either an empty result or too little room so retry with more room up to a limit
+	for ( room = 64 + 4 * seglen; room <= 64 * (64 + 4 * seglen); room *= 4 ) {
+		if ( tc->buflen + room + 1 > tc->bufsize ) {
+			tc->bufsize = tc->buflen + room + 1;
+			tc->buf = realloc(tc->buf,tc->bufsize);
+		}
+		if ( ( n = strftime(&tc->buf[tc->buflen],room,sfmt,tm) ) > 0 )
+			break;
+	}
+
+	tc->buflen += n;
+	tc->buf[tc->buflen] = '\0';
+	free(sfmt);
+}
+
+
+// This adds room for a patched field to the cached rendering
+void
+timecachepatch(struct timecache *tc, int digits) {
+
+	size_t n = ( digits == 0 ) ? 2 : digits;
+
+	if ( tc->buflen + n + 1 > tc->bufsize ) {
+		tc->bufsize = tc->buflen + n + 1;
+		tc->buf = realloc(tc->buf,tc->bufsize);
+	}
+	tc->patchat[tc->npatches] = tc->buflen;
+	tc->patchdigits[tc->npatches] = digits;
+	tc->npatches++;
+
+	memset(&tc->buf[tc->buflen],'0',n);
+	tc->buflen += n;
+	tc->buf[tc->buflen] = '\0';
+}
+
+
+// This renders fmt for the minute (or second) containing t, leaving the fields to be patched zeroed
+void
+timecachefill(struct timecache *tc, char *fmt, time_t t) {
+
+	struct tm *tm = localtime(&t);
+	size_t i = 0;
+	size_t seg = 0;
+	size_t j;
+	int digits;
+	int newfmt = 0;
+
+	if ( tc->fmt == NULL || strcmp(tc->fmt,fmt) != 0 ) {
+		newfmt = 1;
+		free(tc->fmt);
+		tc->fmt = malloc((strlen(fmt)+1) * sizeof(char));
+		strcpy(tc->fmt,fmt);
+	}
+	tc->permin = 1;
+	tc->buflen = 0;
+	tc->npatches = 0;
+
+	if ( tm == NULL ) {
+		anyerrno = errno;
+		diag(DIAG_NUMERIC,"%s",strerror(errno));
+		tc->buf = realloc(tc->buf,1);
+		tc->buf[0] = '\0';
+		tc->permin = 0;
+		tc->minute = tc->second = t;
+		return;
+	}
+
+	while ( fmt[i] != '\0' ) {
+		if ( fmt[i] != '%' ) {
+			i++;
+			continue;
+		}
+
+		// Skip any GNU/BSD flags, width, and E or O modifiers of the conversion
+		j = i + 1 + strspn(&fmt[i+1],"-_0^#");
+		digits = atoi(&fmt[j]);
+		j += strspn(&fmt[j],"0123456789");
+		if ( fmt[j] == 'E' || fmt[j] == 'O' )
+			j++;
+
+		if ( fmt[j] == 'N' || ( fmt[j] == 'S' && j == i+1 ) || ( ( fmt[j] == 'T' || fmt[j] == 'r' ) && j == i+1 ) ) {
+			if ( tc->npatches == TIME_PATCHES_MAX ) {
+				tc->permin = 0;
+				if ( fmt[j] == 'N' ) {
+					// Unlike the rest, strftime(3) doesn't know "%N" so it is left out rather than passed on
+					if ( newfmt ) {
+						anyerrno = EINVAL;
+						diag(DIAG_FORMAT,"More than %d seconds fields in \"%s\" so \"%.*s\" left out",TIME_PATCHES_MAX,fmt,(int) (j+1-i),&fmt[i]);
+					}
+					timecacheappend(tc,i-seg,&fmt[seg],tm);
+					seg = j + 1;
+				}
+				i = j + 1;
+				continue;
+			}
+
+			timecacheappend(tc,i-seg,&fmt[seg],tm);
+			switch (fmt[j]) {
+			case 'N':
+				if ( digits <= 0 || digits > 9 )
+					digits = 9;
+				timecachepatch(tc,digits);
+				break;
+			case 'S':
+				timecachepatch(tc,0);
+				break;
+			case 'T':
+				timecacheappend(tc,strlen("%H:%M:"),"%H:%M:",tm);
+				timecachepatch(tc,0);
+				break;
+			case 'r':
+				timecacheappend(tc,strlen("%I:%M:"),"%I:%M:",tm);
+				timecachepatch(tc,0);
+				timecacheappend(tc,strlen(" %p")," %p",tm);
+				break;
+			}
+			seg = i = j + 1;
+		} else {
+			if ( strchr("sSTrcX+",fmt[j]) != NULL && fmt[j] != '\0' )
+				tc->permin = 0;
+			i = ( fmt[j] == '\0' ) ? j : j + 1;
+		}
+	}
+	timecacheappend(tc,i-seg,&fmt[seg],tm);
+
+	tc->minute = t - tm->tm_sec;
+	tc->second = t;
+}
+
+
+/*
+This renders fmt with strftime(3) for the epoch arg ("SECONDS[.FRACTION]")
+or for the current time if arg is missing, empty, "now" or "-1".  Beyond
+strftime(3), "%N" is the fraction of the second padded or truncated to 9
+digits or to the width given as in "%3N".
+*/
+char *
+time1arg(char *fmt, char *arg) {
+
+	struct timecache *tc;
+	time_t t;
+	char frac[9+1];
+	char *endptr;
+	snum secs;
+	size_t n;
+	int i, k;
+
+	memset(frac,'0',9); frac[9] = '\0';
+
+	if ( arg == NULL || arg[0] == '\0' || strcmp(arg,"now") == 0 || strcmp(arg,"-1") == 0 ) {
+#if defined(CLOCK_REALTIME)
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME,&ts);
+		t = ts.tv_sec;
+		sprintf(frac,"%09ld",(long) ts.tv_nsec);
+#else
+		t = time(NULL);
+#endif // CLOCK_REALTIME
+	} else {
+		errno = 0;
+		secs = strtosint(arg,&endptr,10);
+		if ( endptr[0] == '.' ) {
+			n = strspn(&endptr[1],"0123456789");
+			memcpy(frac,&endptr[1],( n < 9 ) ? n : 9);
+			endptr += 1 + n;
+			// The fraction of a time before the Epoch counts back from the second before it, e.g. -1.25 is 0.75 past -2
+			if ( errno == 0 && arg[strspn(arg," \t\n\v\f\r")] == '-' && strspn(frac,"0") < 9 ) {
+				secs--;
+				// Ten's complement of the digits
+				for ( i = 8; frac[i] == '0'; i-- )
+					;
+				frac[i] = '0' + 10 - (frac[i] - '0');
+				while ( i-- > 0 )
+					frac[i] = '0' + 9 - (frac[i] - '0');
+			}
+		}
+		if ( errno > 0 || endptr == arg || endptr[0] != '\0' ) {
+			anyerrno = ( errno > 0 ) ? errno : EINVAL;
+			if ( errno > 0 )
+				diag(DIAG_NUMERIC,"\"%s\": %s",arg,strerror(errno));
+			else if ( endptr == arg )
+				diag(DIAG_NUMERIC,"\"%s\": expected numeric value",arg);
+			else
+				diag(DIAG_NUMERIC,"\"%s\": not completely converted",arg);
+		}
+		t = (time_t) secs;
+	}
+
+	for ( i = 0; i < TIME_CACHES && ( timecaches[i].fmt == NULL || strcmp(timecaches[i].fmt,fmt) != 0 ); i++ )
+		;
+	if ( i < TIME_CACHES )
+		tc = &timecaches[i];
+	else {
+		tc = &timecaches[nexttimecache];
+		nexttimecache = (nexttimecache + 1) % TIME_CACHES;
+	}
+
+	if ( tc->fmt == NULL || strcmp(tc->fmt,fmt) != 0
+		|| ( tc->permin && ( t < tc->minute || t >= tc->minute + 60 ) )
+		|| ( !tc->permin && t != tc->second ) )
+		timecachefill(tc,fmt,t);
+	tc->second = t;
+
+	for ( i = 0; i < tc->npatches; i++ )
+		if ( tc->patchdigits[i] == 0 ) {
+			k = (int) (t - tc->minute);
+			tc->buf[tc->patchat[i]] = '0' + k / 10;
+			tc->buf[tc->patchat[i]+1] = '0' + k % 10;
+		} else
+			memcpy(&tc->buf[tc->patchat[i]],frac,tc->patchdigits[i]);
+
+	return tc->buf;
+}
+
+
+/*
+This returns the contents of the file at path (or standard input for "-")
+as a null terminated string, e.g. for use as the format operand (-f) or
+an argument (-@).  Regular files are mapped into memory rather than read
+so that only the parts of the file actually processed are ever loaded.
+Since the file may end exactly at the end of a page, an extra zeroed page is reserved past the
+end of the file for the terminating null.  Anything else, or platforms
+without mmap(2), fall back to reading the file into memory.
+*/
+char *
+mapfile(size_t *returnlen, int *returnmapped, char *path) {
+
+	FILE *f;
+	char *buf = NULL;
+	size_t buflen = 0;
+	size_t bufsize = 0;
+	size_t n;
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+	int fd;
+	struct stat st;
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	if ( strcmp(path,"-") != 0 && ( fd = open(path,O_RDONLY) ) >= 0 ) {
+		if ( fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ) {
+			buflen = st.st_size;
+			if ( ( buf = mmap(NULL,buflen+pagesize,PROT_READ,MAP_PRIVATE|MAP_ANONYMOUS,-1,0) ) != MAP_FAILED ) {
+				if ( mmap(buf,buflen,PROT_READ,MAP_PRIVATE|MAP_FIXED,fd,0) != MAP_FAILED ) {
+					close(fd);
+					*returnlen = buflen;
+					*returnmapped = 1;
+					return buf;
+				}
+				munmap(buf,buflen+pagesize);
+			}
+			buf = NULL; buflen = 0;
+		}
+		close(fd);
+	}
+#endif // HAVE_MMAP && MAP_ANONYMOUS
+
+	if ( strcmp(path,"-") == 0 )
+		f = stdin;
+	else if ( ( f = fopen(path,"r") ) == NULL ) {
+		anyerrno = errno;
+		diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+		return NULL;
+	}
+
+	do {
+		if ( bufsize - buflen < BUFSIZ + 1 ) {
+			bufsize = 2 * bufsize + BUFSIZ + 1;
+			buf = realloc(buf,bufsize);
+		}
+		n = fread(&buf[buflen],sizeof(char),bufsize - buflen - 1,f);
+		buflen += n;
+	} while ( n > 0 );
+
+	if ( ferror(f) ) {
+		anyerrno = errno;
+		diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+	}
+	if ( f != stdin )
+		fclose(f);
+
+	buf[buflen] = '\0';
+	*returnlen = buflen;
+	*returnmapped = 0;
+	return buf;
+}
+
+
+// This releases the contents of a file returned by mapfile()
+void
+unmapfile(size_t buflen, int mapped, char *buf) {
+
+#ifdef HAVE_MMAP
+	if ( mapped ) {
+		munmap(buf,buflen+sysconf(_SC_PAGESIZE));
+		return;
+	}
+#endif // HAVE_MMAP
+	free(buf);
+}
+
+
+/*
+This copies the file at path to stream without passing it through
+printf(3).  Where possible sendfile(2) has the kernel copy the file
+directly to the stream's file, whether a file or a pipe, without it ever
+being copied into this process.  Otherwise, e.g. when sendfile(2) refuses
+the combination of files or stream has no file at all, it is copied in
+large blocks with fread(3)/fwrite(3).
+*/
+void
+streamfile(FILE *stream, char *path) {
+
+	char buf[65536];
+	size_t n;
+	FILE *f;
+#ifdef HAVE_SENDFILE
+	int fd;
+	ssize_t e;
+#endif // HAVE_SENDFILE
+
+	if ( ( f = fopen(path,"rb") ) == NULL ) {
+		anyerrno = errno;
+		diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+		return;
+	}
+
+#ifdef HAVE_SENDFILE
+	// Anything already buffered must be output first
+	fflush(stream);
+
+	if ( ( fd = fileno(stream) ) >= 0 ) {
+		while ( ( e = sendfile(fd,fileno(f),NULL,1 << 30) ) > 0 )
+			;
+		if ( e == 0 ) {
+			fclose(f);
+			return;
+		}
+		// Only when sendfile(2) refuses this combination of files fall back to copying from wherever it left off
+		if ( errno != EINVAL && errno != ENOSYS ) {
+			anyerrno = errno;
+			diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+			fclose(f);
+			return;
+		}
+	}
+	// Otherwise (e.g. output to memory) there is no descriptor for sendfile(2)
+#endif // HAVE_SENDFILE
+
+	while ( ( n = fread(buf,sizeof(char),sizeof(buf),f) ) > 0 )
+		fwrite(buf,sizeof(char),n,stream);
+	if ( ferror(f) ) {
+		anyerrno = errno;
+		diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+	}
+	fclose(f);
+}
+
+
+/*
+When one record is output with several formats (see fanoutfmt()) each
+argument would otherwise be converted again by every format consuming it.
+Instead the first conversion of an argument to a number, or its
+unescaping like %b, is kept for the rest of the record along with whether
+it raised any diagnostic, so each is converted and diagnosed only once.
+*/
+#define ARGCACHE_SINT	1
+#define ARGCACHE_UINT	2
+#define ARGCACHE_DOUBLE	4
+#define ARGCACHE_UNESCAPED	8
+
+struct argcache {
+	int have;	// ARGCACHE_* conversions already made
+	snum slli;
+	unum ulli;
+	double d;
+	char *uarg;
+	size_t uarglen;
+	int abort;	// Unescaping uarg ended with "\c"
+};
+
+static struct argcache *argcache;	// One per argument of the current record or NULL if not shared
+static int argcachelen;
+static struct argcache *argcur;	// Entry for the argument currently being output or NULL
+
+
+/*
+While fmtrender() renders a batch, the argument of a conversion output as
+is rather than by printf(3) (e.g. "%s", "%b", "%J" or "%y") isn't copied
+into the output of the batch but left where it is as its span, which
+fmtpull() hands out from at offset "at" of the rest of the output.
+*/
+struct span {
+	long at;
+	char *s;	// NULL if no conversion of the batch has been left in place
+	size_t len;
+	char *owned;	// Freed once the batch has been handed out, e.g. the unescaped argument of "%b"
+};
+
+static struct span *spancur;	// Span of the batch fmtrender() is rendering or NULL
+
+
+// This unescapes arg like %b, only once per record if the argument is shared by several formats
+char *
+unescape1arg(size_t *returnstrlen, char *arg, int *abortext) {
+
+	if ( argcur == NULL )
+		return unescape(returnstrlen,-1,arg,abortext);
+
+	if ( !(argcur->have & ARGCACHE_UNESCAPED) ) {
+		argcur->abort = 0;
+		argcur->uarg = unescape(&argcur->uarglen,-1,arg,&argcur->abort);
+		argcur->have |= ARGCACHE_UNESCAPED;
+	}
+	if ( argcur->abort )
+		*abortext = 1;
+	*returnstrlen = argcur->uarglen;
+
+	return argcur->uarg;
+}
+
+
+// This converts arg with the same rules for numbers as strtoll(3) etc. including 'c or "c for the code of the character c
+void
+parsesint(struct conversion *cv) {
+
+	char *endptr;
+
+	if ( cv->arg != NULL && ( cv->uarg = decimal1arg(&cv->uarglen,cv->fmtlen,cv->fmt,cv->specifier[0],cv->arg) ) != NULL ) {
+		cv->freeuarg = 1;
+		return;
+	}
+
+	if ( argcur != NULL && argcur->have & ARGCACHE_SINT ) {
+		cv->slli = argcur->slli;
+		return;
+	}
+
+	if ( cv->arg != NULL )
+		if ( cv->arg[0] == '\'' || cv->arg[0] == '"' ) {
+			wchar_t *warg = malloc(2 * sizeof(wchar_t)); // arg[0] + arg[1] but no null
+
+			if ( ( mbstowcs(warg,cv->arg,2) ) == (size_t) -1 ) {
+				anyerrno = errno;
+				diag(DIAG_ENCODING,"format conversion: %s",strerror(errno));
+				cv->slli = 0;
+			} else
+				cv->slli = warg[1];
+
+			free(warg);
+		} else { // This is intentionally a macro-generated codeblock not a function
+			strtonum(cv->slli,strtosint(cv->arg,&endptr,numbase),cv->arg,endptr)
+		}
+	else
+		cv->slli = 0;
+
+	if ( argcur != NULL ) {
+		argcur->slli = cv->slli;
+		argcur->have |= ARGCACHE_SINT;
+	}
+}
+
+
+void
+parseuint(struct conversion *cv) {
+
+	char *endptr;
+
+	if ( cv->specifier[0] == 'u' && cv->arg != NULL && ( cv->uarg = decimal1arg(&cv->uarglen,cv->fmtlen,cv->fmt,cv->specifier[0],cv->arg) ) != NULL ) {
+		cv->freeuarg = 1;
+		return;
+	}
+
+	if ( argcur != NULL && argcur->have & ARGCACHE_UINT ) {
+		cv->ulli = argcur->ulli;
+		return;
+	}
+
+	if ( cv->arg != NULL )
+		if ( cv->arg[0] == '\'' || cv->arg[0] == '"' ) {
+			wchar_t *warg = malloc(2 * sizeof(wchar_t)); // arg[0] + arg[1] + but no null
+
+			if ( ( mbstowcs(warg,cv->arg,2) ) == (size_t) -1 ) {
+				anyerrno = errno;
+				diag(DIAG_ENCODING,"format conversion: %s",strerror(errno));
+				cv->ulli = 0;
+			} else
+				cv->ulli = warg[1];
+
+			free(warg);
+		} else { // This is intentionally a macro-generated codeblock not a function
+			strtonum(cv->ulli,strtouint(cv->arg,&endptr,numbase),cv->arg,endptr)
+		}
+	else
+		cv->ulli = 0;
+
+	if ( argcur != NULL ) {
+		argcur->ulli = cv->ulli;
+		argcur->have |= ARGCACHE_UINT;
+	}
+}
+
+
+void
+renderint(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+
+	// Plain decimal arguments are output from their digits by decimal1arg()
+	if ( cv->uarg != NULL ) {
+		fprintf(cv->stream,"%s%s%s",cv->prologue,cv->uarg,cv->epilogue);
+		return;
+	}
+
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(INT_LM),INT_LM,1,cv->specifier);
+	if ( cv->specifier[0] == 'd' || cv->specifier[0] == 'i' )
+		fprintf(cv->stream,ufmt,cv->prologue,(snum) cv->slli,cv->epilogue);
+	else
+		fprintf(cv->stream,ufmt,cv->prologue,(unum) cv->ulli,cv->epilogue);
+	free(ufmt);
+}
+
+
+void
+parsedouble(struct conversion *cv) {
+
+	char *endptr;
+
+	if ( ( cv->specifier[0] == 'f' || cv->specifier[0] == 'F' ) && cv->arg != NULL && ( cv->uarg = decimal1arg(&cv->uarglen,cv->fmtlen,cv->fmt,cv->specifier[0],cv->arg) ) != NULL ) {
+		cv->freeuarg = 1;
+		return;
+	}
+
+	if ( argcur != NULL && argcur->have & ARGCACHE_DOUBLE ) {
+		cv->d = argcur->d;
+		return;
+	}
+
+	if ( cv->arg != NULL ) { // This is intentionally a macro-generated codeblock not a function
+		strtonum(cv->d,strtod(cv->arg,&endptr),cv->arg,endptr)
+	} else
+		cv->d = 0.0;
+
+	if ( argcur != NULL ) {
+		argcur->d = cv->d;
+		argcur->have |= ARGCACHE_DOUBLE;
+	}
+}
+
+
+void
+renderdouble(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+
+	if ( cv->uarg != NULL ) {
+		fprintf(cv->stream,"%s%s%s",cv->prologue,cv->uarg,cv->epilogue);
+		return;
+	}
+
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",1,cv->specifier);
+	fprintf(cv->stream,ufmt,cv->prologue,cv->d,cv->epilogue);
+	free(ufmt);
+}
+
+
+// When rendering for fmtpull(), this outputs arg like "%s" would but left in place as the span of the batch, returning 0 if it can't be
+int
+spanconverted(struct conversion *cv, char *arg) {
+
+	char *c = cv->fmt;
+	int left = 0;
+	unsigned long width;
+	unsigned long prec = ULONG_MAX;
+	size_t len;
+
+	if ( spancur == NULL || spancur->s != NULL )
+		return 0;
+
+	for ( ; c[0] != '\0' && strchr("-+ #",c[0]) != NULL; c++ )
+		if ( c[0] == '-' )
+			left = 1;
+	// Anything else (e.g. the "0" flag, undefined for "%s") is left to printf(3)
+	if ( c[0] == '0' )
+		return 0;
+	width = ( c[0] >= '1' && c[0] <= '9' ) ? strtoul(c,&c,10) : 0;
+	if ( c[0] == '.' ) {
+		c++;
+		prec = ( c[0] >= '0' && c[0] <= '9' ) ? strtoul(c,&c,10) : 0;
+	}
+	if ( c[0] != '\0' || width > INT_MAX )
+		return 0;
+
+	for ( len = 0; len < prec && arg[len] != '\0'; len++ )
+		;
+
+	fprintf(cv->stream,"%s%*s",cv->prologue,( !left && width > len ) ? (int) (width - len) : 0,"");
+	spancur->at = ftell(cv->stream);
+	spancur->s = arg;
+	spancur->len = len;
+	fprintf(cv->stream,"%*s%s",( left && width > len ) ? (int) (width - len) : 0,"",( cv->abort == 0 ) ? cv->epilogue : "");
+
+	if ( arg == cv->uarg && cv->freeuarg ) {
+		spancur->owned = cv->uarg;
+		cv->freeuarg = 0;
+	}
+
+	return 1;
+}
+
+
+// This outputs the argument itself (or the file it references with -@) like printf(3) would
+void
+renderstring(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+	char *arg = cv->arg;
+
+	if ( !( arg != NULL && atfiles && arg[0] == '@' ) && spanconverted(cv,( arg == NULL ) ? "" : arg) )
+		return;
+
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",1,cv->specifier);
+
+	if ( arg != NULL && atfiles && arg[0] == '@' && arg[1] == '@' ) // "@@" -> literal "@"
+		fprintf(cv->stream,ufmt,cv->prologue,&arg[1],cv->epilogue);
+	else if ( arg != NULL && atfiles && arg[0] == '@' && cv->fmtlen == 0 ) {
+		// Without width or precision the file can go directly to the output
+		fprintf(cv->stream,"%s",cv->prologue);
+		streamfile(cv->stream,&arg[1]);
+		fprintf(cv->stream,"%s",cv->epilogue);
+	} else if ( arg != NULL && atfiles && arg[0] == '@' ) {
+		char *contents;
+		size_t contentslen;
+		int mapped;
+
+		if ( ( contents = mapfile(&contentslen,&mapped,&arg[1]) ) != NULL ) {
+			fprintf(cv->stream,ufmt,cv->prologue,contents,cv->epilogue);
+			unmapfile(contentslen,mapped,contents);
+		} else
+			fprintf(cv->stream,ufmt,cv->prologue,"",cv->epilogue);
+	} else if ( arg != NULL )
+		fprintf(cv->stream,ufmt,cv->prologue,arg,cv->epilogue);
+	else
+		fprintf(cv->stream,ufmt,cv->prologue,"",cv->epilogue);
+
+	free(ufmt);
+}
+
+
+// This outputs the argument, or its unescaped form from the parse hook for %Q, as a wide string
+void
+renderwide(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+	char *arg = ( cv->uarg != NULL ) ? cv->uarg : cv->arg;
+
+	// %Q -> %S for call to printf(3)
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",strlen("S"),"S");
+
+	if ( arg != NULL ) {
+		wchar_t *wfmt;
+		size_t nwfmt;
+		wchar_t *warg;
+		size_t nwarg;
+
+		wfmt = malloc((ufmtlen+1) * sizeof(wchar_t)); // Assume wcslen(wfmt) <= strlen(ufmt) && strlen(ufmt) <= ufmtlen
+		if ( ( nwfmt = mbstowcs(wfmt,ufmt,ufmtlen+1) ) == (size_t) -1 ) {
+			anyerrno = errno;
+			diag(DIAG_ENCODING,"format conversion: %s",strerror(errno));
+		} else {
+			warg = malloc((strlen(arg)+1) * sizeof(wchar_t)); // Assume wcslen(warg) <= strlen(arg)
+			if ( ( nwarg = mbstowcs(warg,arg,strlen(arg)+1) ) == (size_t) -1 ) {
+				anyerrno = errno;
+				diag(DIAG_ENCODING,"argument conversion: %s",strerror(errno));
+			} else
+				if ( cv->abort == 0 )
+					fwprintf(cv->stream,wfmt,cv->prologue,warg,cv->epilogue);
+				else
+					fwprintf(cv->stream,wfmt,cv->prologue,warg,L"");
+
+			free(warg);
+		}
+
+		free(wfmt);
+	} else
+		fprintf(cv->stream,ufmt,cv->prologue,L"",cv->epilogue);
+
+	free(ufmt);
+}
+
+
+// This unescapes the argument like %b with "\c" ending all output
+void
+parseunescaped(struct conversion *cv) {
+
+	if ( cv->arg != NULL ) {
+		cv->uarg = unescape1arg(&cv->uarglen,cv->arg,&cv->abort);
+		cv->freeuarg = ( argcur == NULL );
+	}
+}
+
+
+// This outputs the argument as converted by the parse hook (or the argument itself if none) via "%s"
+void
+renderconverted(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+	char *arg = ( cv->uarg != NULL ) ? cv->uarg : cv->arg;
+
+	if ( spanconverted(cv,( arg == NULL ) ? "" : arg) )
+		return;
+
+	// %b, %J, etc -> %s for call to printf(3)
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",strlen("s"),"s");
+
+	if ( cv->abort == 0 )
+		fprintf(cv->stream,ufmt,cv->prologue,( arg == NULL ) ? "" : arg,cv->epilogue);
+	else
+		fprintf(cv->stream,ufmt,cv->prologue,( arg == NULL ) ? "" : arg,"");
+
+	free(ufmt);
+}
+
+
+void
+parsepacked(struct conversion *cv) {
+
+	char *c;
+
+	// The width is the size of the raw bytes so there is nothing for a precision to mean
+	if ( ( c = strchr(cv->fmt,'.') ) != NULL ) {
+		anyerrno = EINVAL;
+		diag(DIAG_FORMAT,"Precision not supported and \"%%%s%s\" truncated to \"%%%.*s%s\"",cv->fmt,cv->specifier,(int) (c-cv->fmt),cv->fmt,cv->specifier);
+		c[0] = '\0';
+		cv->fmtlen = c - cv->fmt;
+	}
+
+	cv->uarg = malloc(8 * sizeof(unsigned char));
+	cv->freeuarg = 1;
+	cv->uarglen = pack1arg((unsigned char *) cv->uarg,cv->fmtlen,cv->fmt,cv->specifier[0],cv->arg);
+}
+
+
+void
+renderpacked(struct conversion *cv) {
+
+	// Raw bytes bypass printf(3) altogether since they may well include nulls
+	fprintf(cv->stream,"%s",cv->prologue);
+	fwrite(cv->uarg,sizeof(unsigned char),cv->uarglen,cv->stream);
+	fprintf(cv->stream,"%s",cv->epilogue);
+}
+
+
+void
+parseescaped(struct conversion *cv) {
+
+	char *c;
+	char *nul;
+	size_t arglen;
+	char *arg = ( cv->arg == NULL ) ? "" : cv->arg;
+
+	// Precision limits the bytes of the argument escaped rather than truncating its escaped form
+	if ( ( c = strchr(cv->fmt,'.') ) != NULL ) {
+		arglen = strtoul(&c[1],NULL,10);
+		if ( ( nul = memchr(arg,'\0',arglen) ) != NULL )
+			arglen = nul - arg;
+		c[0] = '\0';
+		cv->fmtlen = c - cv->fmt;
+	} else
+		arglen = strlen(arg);
+
+	cv->uarg = escape1arg(&cv->uarglen,arglen,arg,cv->specifier[0]);
+	cv->freeuarg = 1;
+}
+
+
+void
+parseencoded(struct conversion *cv) {
+
+	char *c;
+	size_t i, j;
+	size_t arglen;
+	char *arg = cv->arg;
+	char *uarg = NULL;
+	size_t uarglen;
+
+	if ( arg == NULL )
+		arglen = 0;
+	else if ( strchr(cv->fmt,'#') != NULL ) {
+		// The "#" flag processes escape sequences in the argument like %b before encoding
+		arg = uarg = unescape1arg(&uarglen,arg,&cv->abort);
+		arglen = uarglen;
+	} else
+		arglen = strlen(arg);
+
+	for ( i = 0, j = 0; i <= cv->fmtlen && cv->fmt[i] != '\0'; i++ )
+		if ( cv->fmt[i] != '#' )
+			cv->fmt[j++] = cv->fmt[i];
+	cv->fmt[j] = '\0';
+	cv->fmtlen = j;
+
+	// Precision limits the bytes of the argument encoded rather than truncating its encoded form
+	if ( ( c = strchr(cv->fmt,'.') ) != NULL ) {
+		if ( strtoul(&c[1],NULL,10) < arglen )
+			arglen = strtoul(&c[1],NULL,10);
+		c[0] = '\0';
+		cv->fmtlen = c - cv->fmt;
+	}
+
+	cv->uarg = encode1arg(&cv->uarglen,arglen,( arg == NULL ) ? "" : arg,cv->specifier[0]);
+	cv->freeuarg = 1;
+
+	if ( uarg != NULL && argcur == NULL )
+		free(uarg);
+}
+
+
+void
+parsetime(struct conversion *cv) {
+
+	cv->uarg = time1arg(( cv->param == NULL ) ? "%T" : cv->param,cv->arg);
+}
+
+
+void
+renderchar(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",1,cv->specifier);
+
+	if ( cv->arg != NULL )
+		fprintf(cv->stream,ufmt,cv->prologue,(int) cv->arg[0],cv->epilogue);
+	else
+		fprintf(cv->stream,ufmt,cv->prologue,"",cv->epilogue);
+
+	free(ufmt);
+}
+
+
+void
+renderwidechar(struct conversion *cv) {
+
+	char *ufmt;
+	size_t ufmtlen;
+
+	ufmt = prep1fmt(&ufmtlen,cv->fmtlen,cv->fmt,strlen(""),"",1,cv->specifier);
+
+	if ( cv->arg != NULL ) {
+		wchar_t *wfmt;
+		size_t nwfmt;
+		wchar_t warg;
+		size_t nwarg;
+
+		wfmt = malloc((ufmtlen+1) * sizeof(wchar_t)); // Assume wcslen(wfmt) <= strlen(ufmt) && strlen(ufmt) <= ufmtlen
+		if ( ( nwfmt = mbstowcs(wfmt,ufmt,ufmtlen+1) ) == (size_t) -1 ) {
+			anyerrno = errno;
+			diag(DIAG_ENCODING,"format conversion: %s",strerror(errno));
+		} else
+			if ( ( nwarg = mbtowc(&warg,cv->arg,MB_LEN_MAX) ) == (size_t) -1 ) {
+				anyerrno = errno;
+				diag(DIAG_ENCODING,"argument conversion: %s",strerror(errno));
+			} else
+				fwprintf(cv->stream,wfmt,cv->prologue,(wint_t) warg,cv->epilogue);
+
+		free(wfmt);
+	} else
+		fprintf(cv->stream,ufmt,cv->prologue,L"",cv->epilogue);
+
+	free(ufmt);
+}
+
+
+// This registers the built-in specifiers the first time the registry is used
+void
+specinit(void) {
+
+	char *c;
+
+	if ( specinitialized )
+		return;
+	specinitialized = 1;
+	strcpy(specifierset,"%");
+
+	for ( c = "di"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parsesint,renderint);
+	for ( c = "uxXo"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parseuint,renderint);
+	for ( c = "fFeEgGaA"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parsedouble,renderdouble);
+	fmtregister('s',NULL,renderstring);
+	fmtregister('S',NULL,renderwide);
+	fmtregister('c',NULL,renderchar);
+	fmtregister('C',NULL,renderwidechar);
+	fmtregister('b',parseunescaped,renderconverted);
+	fmtregister('Q',parseunescaped,renderwide);
+	for ( c = "wWrR"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parsepacked,renderpacked);
+	for ( c = "JVq"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parseescaped,renderconverted);
+	for ( c = "yYBU"; c[0] != '\0'; c++ )
+		fmtregister(c[0],parseencoded,renderconverted);
+	fmtregister('T',parsetime,renderconverted);
+
+	for ( c = &specifierset[1]; c[0] != '\0'; c++ )
+		specifiers[(unsigned char) c[0]].noparam = ( c[0] != 'T' );
+}
+
+
+/*
+This adds (or with a NULL render hook removes) a conversion specifier.
+Characters that are part of a conversion specification (flags, width,
+precision, length modifiers and parentheses) or that printf(3) would take
+as a specifier that is not supported (e.g. "n") can't be registered.  Any
+"%(...)X" parameter is passed to the hooks of a registered specifier as is.
+*/
+int
+fmtregister(int specifier, fmthook parse, fmthook render) {
+
+	char *c;
+
+	specinit();
+
+	if ( specifier <= 0 || specifier > UCHAR_MAX || strchr("%()$\\-+ #'0123456789.*" PRINTF_LENGTHS PRINTF_SPECIFIERS_INVALID,specifier) != NULL ) {
+		anyerrno = EINVAL;
+		diag(DIAG_INTERNAL,"\"%c\" can't be registered as a conversion specifier",specifier);
+		return -1;
+	}
+
+	specifiers[specifier].parse = parse;
+	specifiers[specifier].render = render;
+	specifiers[specifier].noparam = 0;
+
+	if ( ( c = strchr(specifierset,specifier) ) != NULL && render == NULL )
+		memmove(c,&c[1],strlen(c));
+	else if ( c == NULL && render != NULL ) {
+		c = &specifierset[strlen(specifierset)];
+		c[0] = specifier; c[1] = '\0';
+	}
+
+	return 0;
+}
+
+
+int
+printf1arg(FILE *stream,
+	size_t prologuelen, char *prologue,
+	size_t fmtlen, char *fmt,
+	size_t specifierlen, char *specifier,
+	size_t epiloguelen, char *epilogue, char *arg) {
+
+	int abort = 0;
+
+	size_t uprologuelen; char *uprologue;
+	size_t uepiloguelen; char *uepilogue;
+
+	if ( prologuelen > 0 )
+		uprologue = unescape(&uprologuelen,prologuelen,prologue,NULL);
+	else
+		uprologue = "";
+	if ( epiloguelen > 0 )
+		uepilogue = unescape(&uepiloguelen,epiloguelen,epilogue,NULL);
+	else
+		uepilogue = "";
+
+	// Just print the text if no formats in this batch
+	if ( specifierlen == 0 && fmtlen == 0 )
+		// printf("%s",X) is multiple times faster than printf(X)
+		fprintf(stream,"%s%s",uprologue,uepilogue);
+	else if ( specifierlen == 0 && strcmp(fmt,"%" ) == 0 ) // "Format" of this batch was a "%%"
+		fprintf(stream,"%s%%%s",uprologue,uepilogue);
+	else if ( specifiers[(unsigned char) specifier[0]].render == NULL ) { // Should not be reached unless parse1fmt() matched an unregistered specifier
+		anyerrno = EFAULT;
+		diag(DIAG_INTERNAL,"Internal error with format %s%s",fmt,specifier);
+	} else {
+		struct conversion cv;
+
+		cv.param = NULL;
+
+		// Set aside the parameter of "%(...)X" as it is not part of the format for printf(3)
+		if ( fmtlen > 0 && fmt[fmtlen-1] == ')' && ( cv.param = strchr(fmt,'(') ) != NULL ) {
+			cv.param[0] = '\0';
+			fmtlen = cv.param - fmt;
+			cv.param++;
+			cv.param[strlen(cv.param)-1] = '\0'; // Trailing ")"
+			if ( specifiers[(unsigned char) specifier[0]].noparam ) {
+				anyerrno = EINVAL;
+				diag(DIAG_FORMAT,"Illegal format \"%%%s(%s)%s\" truncated to \"%%%s%s\"",fmt,cv.param,specifier,fmt,specifier);
+				cv.param = NULL;
+			}
+		}
+
+		// Sanitize fmt for anything that would throw off call printf(3) such as causing it to read an extra argument
+		fmtlen = sanitize1fmt(fmtlen,fmt,specifierlen,specifier);
+
+		cv.stream = stream;
+		cv.prologue = uprologue;
+		cv.epilogue = uepilogue;
+		cv.fmtlen = fmtlen;
+		cv.fmt = fmt;
+		cv.specifier[0] = specifier[0]; cv.specifier[1] = '\0';
+		cv.arg = arg;
+		cv.uarg = NULL;
+		cv.uarglen = 0;
+		cv.freeuarg = 0;
+		cv.abort = 0;
+
+		if ( specifiers[(unsigned char) cv.specifier[0]].parse != NULL )
+			specifiers[(unsigned char) cv.specifier[0]].parse(&cv);
+		specifiers[(unsigned char) cv.specifier[0]].render(&cv);
+
+		abort = cv.abort;
+		if ( cv.freeuarg )
+			free(cv.uarg);
+	}
+
+	if ( epiloguelen > 0 ) free(uepilogue);
+	if ( prologuelen > 0 ) free(uprologue);
+
+	return abort;
+}
+
+
+// Like strspn(3) and strcspn(3) but never looking beyond n bytes of s, which needn't be null terminated
+size_t
+boundedspn(size_t n, char *s, char *accept) {
+
+	size_t i;
+
+	for ( i = 0; i < n && s[i] != '\0' && strchr(accept,s[i]) != NULL; i++ )
+		;
+
+	return i;
+}
+
+size_t
+boundedcspn(size_t n, char *s, char *reject) {
+
+	size_t i;
+
+	for ( i = 0; i < n && s[i] != '\0' && strchr(reject,s[i]) == NULL; i++ )
+		;
+
+	return i;
+}
+
+// This returns the length of the text before any "%" within n bytes of s, using memchr(3) and strnlen(3) as text is most of a typical format
+size_t
+textlen(size_t n, char *s) {
+
+	char *c = memchr(s,'%',n);
+
+	return strnlen(s,( c != NULL ) ? (size_t) (c-s) : n);
+}
+
+
+/*
+This breaks the next batch off of fmt.  Rather than copies, the prologue
+(s1) and epilogue (s5) are returned as pointers into fmt along with their
+lengths so that the size of the format operand doesn't dictate the size
+of any buffer.  Only the format (s3) is copied into a buffer, grown as
+needed, since it is edited before the call to printf(3).
+*/
+int
+parse1fmt(size_t *returnn1, char **s1,
+	size_t *returnn2, char *s2,
+	size_t *returnn3, char **s3, size_t *s3size,
+	size_t *returnn4, char *s4,
+	size_t *returnn5, char **s5,
+	size_t fmtlen, char *fmt) {
+
+	size_t n;
+	size_t n1 = 0;
+	size_t n2 = 0;
+	size_t n3 = 0;
+	size_t n4 = 0;
+	size_t n5 = 0;
+	size_t k;
+
+	specinit();
+
+	// Nothing beyond fmtlen is looked at as fmt needn't be null terminated (e.g. from fmtopen())
+	n1 = textlen(fmtlen,fmt);
+	*s1 = fmt;
+
+	if ( n1 == fmtlen || fmt[n1] == '\0' ) { // This is ^[^%]+ -> all text no printf format
+		n = n1;
+		s2[0] = '\0';
+		(*s3)[0] = '\0';
+		s4[0] = '\0';
+	} else {
+		strcpy(s2,"%"); n2 = strlen("%");
+
+		n = n1 + n2 + boundedspn(fmtlen-(n1+n2),&fmt[n1+n2],"-+ #0123456789.*");
+		if ( n < fmtlen && fmt[n] == '(' && ( k = n + boundedcspn(fmtlen-n,&fmt[n],")") ) + 1 < fmtlen && fmt[k] == ')' && specifiers[(unsigned char) fmt[k+1]].render != NULL )
+			// A "%(...)X" conversion is matched first as its parameter (e.g. the strftime(3) format of "%(...)T") would otherwise end it at any "%" or specifier
+			n3 = (k+1) - (n1+n2);
+		else if ( n1+n2 < fmtlen && fmt[n1+n2] == '%' ) // "Format" of this batch is a "%%"
+			n3 = strlen("%");
+		else
+			n3 = boundedcspn(fmtlen-(n1+n2),&fmt[n1+n2],specifierset);
+
+		if ( n3 + 1 > *s3size ) {
+			*s3size = n3 + 1;
+			*s3 = realloc(*s3,*s3size);
+		}
+		memcpy(*s3,&fmt[n1+n2],n3); (*s3)[n3] = '\0';
+		n = n1 + n2 + n3;
+
+		if ( strcmp(*s3,"%") == 0 )
+			s4[0] = '\0';
+		else if ( n < fmtlen && fmt[n] != '\0' && fmt[n] != '%' ) { // This is [^%]*%[^%specifierset]*[specifierset]
+			s4[0] = fmt[n]; s4[1] = '\0'; n4 = 1;
+			n += n4;
+		} else if ( n1+n2 == fmtlen || fmt[n1+n2] == '\0' ) { // A "%" ending the format is dropped without a diagnostic as it always has been
+			s2[0] = '\0'; n2 = 0;
+			(*s3)[0] = '\0'; n3 = 0;
+			s4[0] = '\0';
+			n = n1 + strlen("%");
+		} else if ( n1 == 0 ) { // This is %[^%specifierset]* at the start of the batch -> only the "%" is dropped and the rest is output as text
+			anyerrno = EINVAL;
+			diag(DIAG_FORMAT,"Illegal format \"%%%c\" truncated to \"%c\"",fmt[n2],fmt[n2]);
+			s2[0] = '\0'; n2 = 0;
+			(*s3)[0] = '\0'; n3 = 0;
+			s4[0] = '\0';
+			n = strlen("%");
+		} else { // This is [^%]+%[^%specifierset]*$ -> no final printf specifier -> likely invalid printf format but still need to advance past the format and process any remaining text
+			anyerrno = EINVAL;
+			diag(DIAG_FORMAT,"Illegal format \"%.*s\" truncated",(int) (n2+n3),&fmt[n1]);
+			s2[0] = '\0'; n2 = 0;
+			(*s3)[0] = '\0'; n3 = 0;
+			s4[0] = '\0';
+		}
+	}
+
+	// The epilogue is any text up to the next conversion specification
+	if ( n4 > 0 ) {
+		*s5 = &fmt[n];
+		n5 = textlen(fmtlen-n,*s5);
+		n += n5;
+	} else
+		*s5 = "";
+
+	*returnn1 = n1; *returnn2 = n2; *returnn3 = n3; *returnn4 = n4; *returnn5 = n5;
+
+	return n;
+}
+
+
+int
+fmtpullparams(size_t *n3, char *s3, int numargs, char *args[], int nextarg) {
+
+	char	*c;
+	size_t	fmt_width_i;
+	int	fmt_width_arg;
+	size_t	fmt_width_strlen;
+	size_t	fmt_prec_i;
+	int	fmt_prec_arg;
+	size_t	fmt_prec_strlen;
+	size_t	paramat;
+
+	// Any "*" of a "%(...)X" parameter (e.g. a strftime(3) format) is left to its specifier
+	paramat = strcspn(s3,"(");
+
+	c = memchr(s3,'*',paramat);
+	if ( c != NULL ) {
+		fmt_width_i = (c-s3);
+		fmt_width_arg = nextarg;
+		if ( args[fmt_width_arg] == NULL )
+			fmt_width_strlen=0;
+		else
+			fmt_width_strlen=strlen(args[nextarg]);
+		if ( nextarg < numargs )
+			nextarg++;
+
+		c = strstr(&c[1],".*");
+		if ( c != NULL && (size_t) (c-s3) < paramat ) {
+			fmt_prec_i = (c-s3);
+			fmt_prec_arg = nextarg;
+			if ( args[fmt_prec_arg] == NULL)
+				fmt_prec_strlen = 0;
+			else
+				fmt_prec_strlen = strlen(args[fmt_prec_arg]);
+			if ( nextarg < numargs )
+				nextarg++;
+
+			// The rest of the format (length modifiers and any parameter) follows the substituted width and precision
+			memmove(&s3[fmt_width_i+fmt_width_strlen+1+fmt_prec_strlen],&s3[fmt_prec_i+strlen(".*")],strlen(&s3[fmt_prec_i+strlen(".*")])+1);
+			memmove(&s3[fmt_width_i],args[fmt_width_arg],fmt_width_strlen);
+			s3[fmt_width_i+fmt_width_strlen]='.';
+			memmove(&s3[fmt_width_i+fmt_width_strlen+1],args[fmt_prec_arg],fmt_prec_strlen);
+		} else {
+			memmove(&s3[fmt_width_i+fmt_width_strlen],&s3[fmt_width_i+1],strlen(&s3[fmt_width_i+1])+1);
+			memmove(&s3[fmt_width_i],args[fmt_width_arg],fmt_width_strlen);
 		}
+		*n3 = strlen(s3);
 	}
 
 	return nextarg;
 }
 
 
+// This outputs the next batch of fmt to stream, returning the length of fmt consumed via returnn and nonzero if output should stop
 int
-parsefmt(size_t fmtlen, char *fmt, int numargs, char *args[]) {
+printf1batch(FILE *stream, size_t *returnn, size_t fmtlen, char *fmt, int numargs, char *args[], int *nextarg, char **s3, size_t *s3size) {
 
-	int nextarg = 0;
-	char *s1 = malloc((fmtlen+1) * sizeof(char));
+	char *s1;
 	char s2[2];
-	char *s3 = malloc((fmtlen+1) * sizeof(char));
 	char s4[2];
-	char *s5 = malloc((fmtlen+1) * sizeof(char));
+	char *s5;
 	size_t n1,n2,n3,n4,n5;
-	size_t n;
+	size_t room;
+	int abort;
+
+	diagarg = 0;
+	*returnn = parse1fmt(&n1,&s1,&n2,s2,&n3,s3,s3size,&n4,s4,&n5,&s5,fmtlen,fmt);
+
+	if ( n3 > 0 ) {
+		// Make room for substituting up to two arguments for "*" in the format
+		room = n3 + 1;
+		if ( *nextarg < numargs )
+			room += strlen(args[*nextarg]);
+		if ( *nextarg+1 < numargs )
+			room += strlen(args[*nextarg+1]);
+		if ( room > *s3size ) {
+			*s3size = room;
+			*s3 = realloc(*s3,*s3size);
+		}
+
+		*nextarg = fmtpullparams(&n3,*s3,numargs,args,*nextarg);
+	}
+
+	diagarg = ( *nextarg < numargs ) ? diagargbase + *nextarg + 1 : 0;
+	argcur = ( n4 > 0 && *nextarg < argcachelen ) ? &argcache[*nextarg] : NULL;
+	abort = printf1arg(stream,n1,s1,n3,*s3,n4,s4,n5,s5,args[*nextarg]);
+	argcur = NULL;
+	diagarg = 0;
+
+	if ( n4 > 0 && *nextarg < numargs )
+		(*nextarg)++;
+
+	return abort;
+}
+
+
+int
+parsefmt(FILE *stream, size_t fmtlen, char *fmt, int numargs, char *args[]) {
 
-	while ( fmt[0] != '\0' ) {
-		n = parse1fmt(&n1,s1,&n2,s2,&n3,s3,&n4,s4,&n5,s5,fmtlen,fmt);
+	int nextarg = 0;
+	size_t s3size = 32;
+	char *s3 = malloc(s3size * sizeof(char));
+	size_t n;
+	char *end = &fmt[fmtlen];
 
-		if ( n3 > 0 )
-			nextarg = fmtpullparams(&n3,s3,numargs,args,nextarg);
+	diagrecord++;
 
-		if ( printf1arg(n1,s1,n3,s3,n4,s4,n5,s5,args[nextarg]) != 0 ) {
-			free(s5); free(s3); free(s1);
+	while ( fmt < end && fmt[0] != '\0' ) {
+		if ( printf1batch(stream,&n,end-fmt,fmt,numargs,args,&nextarg,&s3,&s3size) != 0 ) {
+			anyabort = 1;
+			free(s3);
+			diagargbase += numargs;
 			return numargs;
 		}
-		if ( n4 > 0 && nextarg < numargs )
-			nextarg++;
 		fmt += n;
 	}
 
-	free(s5); free(s3); free(s1);
+	free(s3);
+	diagargbase += nextarg;
 
 	return nextarg;
 }
 
 
+/*
+Several formats (each with its own output) can render the same stream of
+records in one pass, e.g. a log line, a CSV row and a JSON line.  Every
+format of a record starts at the same argument and the record consumes as
+many arguments as the greediest of them.  The arguments of each record are
+shared through an argcache so that each is converted only once however
+many formats output it, and each output keeps its own stdio buffer so the
+outputs are still written in large blocks rather than interleaved.
+*/
+struct fanout {
+	size_t fmtlen;
+	char *fmt;
+	FILE *stream;
+	int window;	// Most arguments fmt could consume in one record
+};
+
+
+// This initializes fo for fmt output to stream
+void
+fanoutinit(struct fanout *fo, size_t fmtlen, char *fmt, FILE *stream) {
+
+	char *c;
+	char *d;
+	size_t n;
+
+	fo->fmtlen = fmtlen;
+	fo->fmt = fmt;
+	fo->stream = stream;
+
+	// One argument per conversion specification and one per "*" at most, skipping any "%(...)X" parameter
+	fo->window = 1;
+	for ( c = strpbrk(fmt,"%*"); c != NULL; c = strpbrk(&c[1],"%*") ) {
+		fo->window++;
+		if ( c[0] == '%' ) {
+			n = strspn(&c[1],"-+ #0123456789.*");
+			for ( d = &c[1]; d <= &c[n]; d++ )
+				if ( d[0] == '*' )
+					fo->window++;
+			c = &c[n];
+			if ( c[1] == '(' && ( d = strchr(&c[1],')') ) != NULL )
+				c = d;
+		}
+	}
+}
+
+
+// This outputs one record with every format, returning the number of arguments consumed
+int
+fanoutfmt(int nfo, struct fanout *fo, int numargs, char *args[]) {
+
+	int consumed;
+	int most = 0;
+	int i;
+	unsigned long record = diagrecord;
+	unsigned long base = diagargbase;
+
+	if ( nfo == 1 )
+		return parsefmt(fo[0].stream,fo[0].fmtlen,fo[0].fmt,numargs,args);
+
+	argcachelen = 0;
+	for ( i = 0; i < nfo; i++ )
+		if ( fo[i].window > argcachelen )
+			argcachelen = fo[i].window;
+	if ( argcachelen > numargs )
+		argcachelen = numargs;
+	argcache = calloc(argcachelen > 0 ? argcachelen : 1,sizeof(struct argcache));
+
+	for ( i = 0; i < nfo && !anyabort; i++ ) {
+		// Each format outputs the same record
+		diagrecord = record;
+		diagargbase = base;
+
+		consumed = parsefmt(fo[i].stream,fo[i].fmtlen,fo[i].fmt,numargs,args);
+		if ( consumed > most )
+			most = consumed;
+	}
+	diagargbase = base + most;
+
+	for ( i = 0; i < argcachelen; i++ )
+		if ( argcache[i].have & ARGCACHE_UNESCAPED )
+			free(argcache[i].uarg);
+	free(argcache);
+	argcache = NULL;
+	argcachelen = 0;
+
+	return most;
+}
+
+
+/*
+A formatter that can be resumed for embedding printf(1) in programs such as
+event loops that cannot block on output.  Rather than running each cycle
+through the format to completion writing to stdout, fmtpull() fills the
+caller's buffer with as much output as fits and picks up from exactly the
+same point on the next call, even partway through the output of a single
+conversion.  Each batch is rendered into pending except for the span of
+its argument (see struct span) which is handed out from where it is.
+*/
+struct fmtstate {
+	char *fmt;
+	char *pos;	// Start of the next batch of fmt
+	char *end;
+	int numargs;
+	char **args;
+	int nextarg;
+	int cyclearg;	// nextarg at the start of the current cycle through fmt
+	unsigned long record;
+	int done;
+	int error;	// First errno-style error of this formatter for fmterror()
+	char *s3;
+	size_t s3size;
+	char *pending;	// Output of the current batch not yet handed out
+	size_t pendinglen;
+	size_t pendingoff;	// Offset into the output of the batch, i.e. pending with the span inserted
+	struct span span;
+};
+
+
+struct fmtstate *
+fmtopen(size_t fmtlen, char *fmt, int numargs, char *args[]) {
+
+	struct fmtstate *st = malloc(sizeof(struct fmtstate));
+
+	st->fmt = st->pos = fmt;
+	st->end = &fmt[fmtlen];
+	st->numargs = numargs;
+	// Copied so that, like argv, args[numargs] is NULL
+	st->args = malloc((numargs+1) * sizeof(char *));
+	if ( numargs > 0 )
+		memcpy(st->args,args,numargs * sizeof(char *));
+	st->args[numargs] = NULL;
+	st->nextarg = st->cyclearg = 0;
+	st->record = 1;
+	st->done = 0;
+	st->error = 0;
+	st->s3size = 32;
+	st->s3 = malloc(st->s3size * sizeof(char));
+	st->pending = NULL;
+	st->pendinglen = st->pendingoff = 0;
+	st->span.s = st->span.owned = NULL;
+	st->span.len = 0;
+	st->span.at = 0;
+
+	return st;
+}
+
+
+// This renders the next batch of the format into st->pending, returning 0 once there is nothing more to output
+int
+fmtrender(struct fmtstate *st) {
+
+	FILE *stream;
+	size_t n;
+	int abort;
+	int wasanyerrno = anyerrno;
+#ifdef HAVE_OPEN_MEMSTREAM
+	size_t len;
+#else
+	long len;
+#endif // open_memstream
+
+	free(st->pending);
+	st->pending = NULL;
+	st->pendinglen = st->pendingoff = 0;
+	free(st->span.owned);
+	st->span.s = st->span.owned = NULL;
+	st->span.len = 0;
+
+	if ( !st->done && ( st->pos >= st->end || st->pos[0] == '\0' ) ) {
+		// Like main(), cycle through the format again only while arguments remain and the last cycle consumed some
+		if ( st->nextarg > st->cyclearg && st->nextarg < st->numargs ) {
+			st->pos = st->fmt;
+			st->cyclearg = st->nextarg;
+			st->record++;
+		} else
+			st->done = 1;
+	}
+	if ( st->done )
+		return 0;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	stream = open_memstream(&st->pending,&len);
+#else
+	stream = tmpfile();
+#endif // open_memstream
+	if ( stream == NULL ) {
+		if ( st->error == 0 )
+			st->error = errno;
+		diag(DIAG_FILE,"%s",strerror(errno));
+		st->done = 1;
+		return 0;
+	}
+
+	// Errors are kept with each formatter rather than in anyerrno so that several can be open at once
+	anyerrno = 0;
+	diagrecord = st->record;
+	diagargbase = 0;
+	spancur = &st->span;
+	abort = printf1batch(stream,&n,st->end - st->pos,st->pos,st->numargs,st->args,&st->nextarg,&st->s3,&st->s3size);
+	spancur = NULL;
+	st->pos += n;
+	if ( abort != 0 )
+		st->done = 1;
+	if ( anyerrno > 0 && st->error == 0 )
+		st->error = anyerrno;
+	anyerrno = wasanyerrno;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	fclose(stream);
+#else
+	len = ftell(stream);
+	rewind(stream);
+	st->pending = malloc(len > 0 ? len : 1);
+	len = fread(st->pending,sizeof(char),len,stream);
+	fclose(stream);
+#endif // open_memstream
+	st->pendinglen = len;
+	if ( st->span.s == NULL )
+		st->span.at = len;
+
+	return 1;
+}
+
+
+// This copies up to bufsize bytes of output into buf, returning how many or 0 once all output has been pulled
+size_t
+fmtpull(struct fmtstate *st, char *buf, size_t bufsize) {
+
+	size_t n = 0;
+	size_t k;
+	size_t at;
+	char *src;
+
+	while ( n < bufsize ) {
+		if ( st->pendingoff < st->pendinglen + st->span.len ) {
+			// The output of the batch is pending up to the span, the span and then the rest of pending
+			at = (size_t) st->span.at;
+			if ( st->pendingoff < at ) {
+				src = &st->pending[st->pendingoff];
+				k = at - st->pendingoff;
+			} else if ( st->pendingoff < at + st->span.len ) {
+				src = &st->span.s[st->pendingoff - at];
+				k = at + st->span.len - st->pendingoff;
+			} else {
+				src = &st->pending[st->pendingoff - st->span.len];
+				k = st->pendinglen + st->span.len - st->pendingoff;
+			}
+			if ( k > bufsize - n )
+				k = bufsize - n;
+			memcpy(&buf[n],src,k);
+			st->pendingoff += k;
+			n += k;
+		} else if ( fmtrender(st) == 0 )
+			break;
+	}
+
+	return n;
+}
+
+
+int
+fmterror(struct fmtstate *st) {
+
+	return st->error;
+}
+
+
+void
+fmtclose(struct fmtstate *st) {
+
+	free(st->pending);
+	free(st->span.owned);
+	free(st->s3);
+	free(st->args);
+	free(st);
+}
+
+
+/*
+Room for the digits of the widest snum plus sign and null as well as
+a generous amount of zero padding requested via the width of a range.
+*/
+#define RANGE_WIDTH_MAX	64
+#define RANGE_BUFLEN	(RANGE_WIDTH_MAX + 3 * sizeof(snum) + 2)
+
+struct range {
+	snum next;	// Value of the next argument to generate
+	snum last;
+	snum step;
+	int width;	// Minimum number of digits, zero filled
+	int done;
+	size_t start;	// Decimal rendering of next is &buf[start] through the end of buf
+	char buf[RANGE_BUFLEN];
+};
+
+
+// This parses "FIRST:LAST[:STEP[:WIDTH]]" into a range ready for rangenext()
+int
+rangeinit(struct range *r, char *spec) {
+
+	char *c = spec;
+	char *endptr;
+	long w = 0;
+
+	r->step = 1;
+
+	errno = 0;
+	r->next = strtosint(c,&endptr,10);
+	if ( errno == 0 && endptr != c && endptr[0] == ':' ) {
+		c = &endptr[1];
+		r->last = strtosint(c,&endptr,10);
+		if ( errno == 0 && endptr != c && endptr[0] == ':' ) {
+			c = &endptr[1];
+			r->step = strtosint(c,&endptr,10);
+			if ( errno == 0 && endptr != c && endptr[0] == ':' ) {
+				c = &endptr[1];
+				w = strtol(c,&endptr,10);
+			}
+		}
+	} else if ( errno == 0 )
+		errno = EINVAL;
+
+	if ( errno > 0 || endptr == c || endptr[0] != '\0' || r->step == 0 || w < 0 || w > RANGE_WIDTH_MAX ) {
+		anyerrno = ( errno > 0 ) ? errno : EINVAL;
+		diag(DIAG_NUMERIC,"\"%s\": invalid range",spec);
+		return -1;
+	}
+
+	r->width = (int) w;
+	r->done = ( r->step > 0 ) ? ( r->next > r->last ) : ( r->next < r->last );
+
+	sprintf(r->buf,"%.*" INT_LM "d",( r->width > 0 ) ? r->width : 1,r->next);
+	r->start = RANGE_BUFLEN - 1 - strlen(r->buf);
+	memmove(&r->buf[r->start],r->buf,RANGE_BUFLEN - r->start);
+
+	return 0;
+}
+
+
+/*
+This copies the decimal rendering of the next value of the range into arg
+and then advances the range.  Rather than reformatting each value from
+scratch, non-negative values counting up are advanced by adding step to
+the previous rendering in place digit-by-digit, which usually touches only
+the last digit or two (and leaves any zero padding intact).
+*/
+int
+rangenext(struct range *r, char *arg) {
+
+	snum carry;
+	size_t i;
+	int digit;
+
+	if ( r->done )
+		return 0;
+
+	memcpy(arg,&r->buf[r->start],RANGE_BUFLEN - r->start);
+
+	// Unsigned distances so that neither this nor the step can overflow
+	if ( ( r->step > 0 && (unum) r->last - (unum) r->next < (unum) r->step )
+		|| ( r->step < 0 && (unum) r->next - (unum) r->last < (unum) 0 - (unum) r->step ) ) {
+		r->done = 1;
+		return 1;
+	}
+
+	if ( r->step > 0 && r->next >= 0 ) {
+		r->next += r->step;
+		carry = r->step;
+		for ( i = RANGE_BUFLEN - 2; carry > 0; i-- ) {
+			if ( i < r->start ) {
+				r->buf[i] = '0';
+				r->start = i;
+			}
+			digit = (r->buf[i] - '0') + (int) (carry % 10);
+			carry = carry / 10 + digit / 10;
+			r->buf[i] = '0' + digit % 10;
+		}
+	} else {
+		r->next += r->step;
+		sprintf(r->buf,"%.*" INT_LM "d",( r->width > 0 ) ? r->width : 1,r->next);
+		r->start = RANGE_BUFLEN - 1 - strlen(r->buf);
+		memmove(&r->buf[r->start],r->buf,RANGE_BUFLEN - r->start);
+	}
+
+	return 1;
+}
+
+
+/*
+This cycles through the format operand like main() does for argument
+operands but with arguments generated by a range.  No more arguments are
+generated ahead of time than the formats could consume in a single
+cycle (i.e. one per conversion specification and one per "*"), and buffers
+holding arguments not consumed by one cycle are rotated to the front of
+the window for the next.
+*/
+void
+rangefmt(int nfo, struct fanout *fo, struct range *r) {
+
+	int window = 1;
+	int filled = 0;
+	int consumed;
+	int i;
+	char **slot;
+	char **args;
+
+	for ( i = 0; i < nfo; i++ )
+		if ( fo[i].window > window )
+			window = fo[i].window;
+
+	// Like seq(1), an empty range outputs nothing at all
+	if ( r->done )
+		return;
+
+	// Zero filled arguments are still decimal rather than octal
+	numbase = 10;
+
+	slot = malloc(window * sizeof(char *));
+	args = malloc((window+1) * sizeof(char *));
+	for ( i = 0; i < window; i++ )
+		slot[i] = malloc(RANGE_BUFLEN * sizeof(char));
+
+	do {
+		while ( filled < window && rangenext(r,slot[filled]) )
+			filled++;
+		for ( i = 0; i < filled; i++ )
+			args[i] = slot[i];
+		args[filled] = NULL;
+
+		consumed = fanoutfmt(nfo,fo,filled,args);
+
+		for ( i = 0; i < consumed; i++ )
+			args[i] = slot[i];
+		for ( i = 0; i < window - consumed; i++ )
+			slot[i] = slot[i + consumed];
+		for ( i = 0; i < consumed; i++ )
+			slot[window - consumed + i] = args[i];
+		filled -= consumed;
+	} while ( consumed > 0 && filled + !r->done > 0 && !anyabort );
+
+	for ( i = 0; i < window; i++ )
+		free(slot[i]);
+	free(args); free(slot);
+}
+
+
+/*
+Outputs named by -o are opened only once a format is added for them so
+that a trailing -o never creates or truncates a file.  Naming the same
+file again gets the stream already open for it rather than truncating
+what was already written to it.
+*/
+struct output {
+	char *path;
+	FILE *stream;
+};
+
+
+// This returns the stream for path ("-" for stdout), opening it unless already open, or NULL on error
+FILE *
+openoutput(struct output *out, int *nout, char *path) {
+
+	int i;
+#ifdef HAVE_MMAP
+	struct stat st, ost;
+	int exists = ( stat(path,&st) == 0 );
+#endif // HAVE_MMAP
+
+	if ( strcmp(path,"-") == 0 )
+		return stdout;
+
+	for ( i = 0; i < *nout; i++ ) {
+		if ( strcmp(out[i].path,path) == 0 )
+			return out[i].stream;
+#ifdef HAVE_MMAP
+		// The same file by another name, e.g. "./x" for "x"
+		if ( exists && fstat(fileno(out[i].stream),&ost) == 0 && st.st_dev == ost.st_dev && st.st_ino == ost.st_ino )
+			return out[i].stream;
+#endif // HAVE_MMAP
+	}
+
+	if ( ( out[*nout].stream = fopen(path,"w") ) == NULL ) {
+		anyerrno = errno;
+		diag(DIAG_FILE,"\"%s\": %s",path,strerror(errno));
+		return NULL;
+	}
+	out[*nout].path = path;
+
+	return out[(*nout)++].stream;
+}
+
+
 void
 usage(void)
 {
-	fprintf(stderr, "usage: printf format [arguments ...]\n");
+	fprintf(stderr, "usage: printf [-@] [-j] [-l limit] [-r first:last[:step[:width]]] format [arguments ...]\n");
+	fprintf(stderr, "       printf [-@] [-j] [-l limit] [-r first:last[:step[:width]]] [-o output] -e format | -f file ... [arguments ...]\n");
 }
 
 
+#ifndef PRINTF_NO_MAIN
 int
 main (int argc, char *argv[]) {
 
-	char *fmt;
+	char *fmt = NULL;
+	size_t fmtlen;
 	int nextarg;
+	char *rangespec = NULL;
+	int fmtmapped;
+	struct range r;
+	struct fanout *fo;
+	int nfo = 0;
+	FILE *output = stdout;
+	char *outputpath = NULL;	// Path of the last -o until a format is added for it
+	struct output *out;
+	int nout = 0;
+	int badoption = 0;
 
 // Use hardcoded strings until call to setlocale(3)
 #ifdef HAVE_PLEDGE
-	if (pledge("stdio", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath", NULL) == -1)
 #ifdef __OpenBSD__
 		err(1, "pledge");
 #else
@@ -887,22 +2957,118 @@ main (int argc, char *argv[]) {
 	if ( argc > nextarg ) {
 		progname = argv[nextarg]; nextarg++;
 
+		// Diagnostics are buffered like any other output rather than written one at a time
+		setvbuf(stderr,NULL,_IOFBF,BUFSIZ);
+
 		if ( setlocale(LC_ALL, "") == NULL )
 			fprintf(stderr,"%s: Warning: current locale not valid\n",progname); // Assume that if argv[0] exists it is a valid string in the default C locale but without a successful setlocale(3) just fallback to a hardcoded string for the rest
 
-		if ( argc > nextarg ) {
+		fo = malloc(argc * sizeof(struct fanout)); // Can't be more formats (or outputs) than arguments
+		out = malloc(argc * sizeof(struct output));
+
+		// Only options exactly matching these are recognized so that any other format operand starting with "-" still works as before
+		while ( argc > nextarg && argv[nextarg][0] == '-' ) {
+			if ( strcmp(argv[nextarg],"--") == 0 ) {
+				nextarg++;
+				break;
+			} else if ( strcmp(argv[nextarg],"-r") == 0 && argc > nextarg+1 ) {
+				rangespec = argv[nextarg+1]; nextarg += 2;
+			} else if ( strcmp(argv[nextarg],"-j") == 0 ) {
+				diagjson = 1; nextarg++;
+			} else if ( strcmp(argv[nextarg],"-l") == 0 && argc > nextarg+1 ) {
+				char *endptr;
+				int wasanyerrno = anyerrno;
+
+				anyerrno = 0;
+				if ( argv[nextarg+1][0] >= '0' && argv[nextarg+1][0] <= '9' ) { // Not even a sign, which strtoul(3) would accept
+					// This is intentionally a macro-generated codeblock not a function
+					strtonum(diaglimit,strtoul(argv[nextarg+1],&endptr,10),argv[nextarg+1],endptr)
+				} else {
+					anyerrno = EINVAL;
+					diag(DIAG_NUMERIC,"\"%s\": expected numeric value",argv[nextarg+1]);
+				}
+				if ( anyerrno > 0 ) {
+					diaglimit = 0;
+					usage();
+					badoption = 1;
+				} else
+					anyerrno = wasanyerrno;
+				nextarg += 2;
+			} else if ( strcmp(argv[nextarg],"-@") == 0 ) {
+				atfiles = 1; nextarg++;
+			} else if ( ( strcmp(argv[nextarg],"-e") == 0 || strcmp(argv[nextarg],"-f") == 0 ) && argc > nextarg+1 ) {
+				if ( argv[nextarg][1] == 'f' )
+					fmt = mapfile(&fmtlen,&fmtmapped,argv[nextarg+1]);
+				else {
+					fmt = argv[nextarg+1];
+					fmtlen = strlen(fmt);
+				}
+				if ( outputpath != NULL ) {
+					output = openoutput(out,&nout,outputpath);
+					outputpath = NULL;
+				}
+				if ( fmt == NULL || output == NULL )
+					badoption = 1;
+				else
+					fanoutinit(&fo[nfo++],fmtlen,fmt,output);
+				nextarg += 2;
+			} else if ( strcmp(argv[nextarg],"-o") == 0 && argc > nextarg+1 ) {
+				// Formats following this are output to it
+				outputpath = argv[nextarg+1]; nextarg += 2;
+			} else
+				break;
+		}
+
+		if ( outputpath != NULL ) {
+			anyerrno = EINVAL;
+			diag(DIAG_FORMAT,"No -e or -f format for -o \"%s\"",outputpath);
+			usage();
+			badoption = 1;
+		}
+
+		if ( nfo == 0 && !badoption && argc > nextarg ) {
 			fmt = argv[nextarg]; nextarg++;
+			fanoutinit(&fo[nfo++],strlen(fmt),fmt,stdout);
+		}
 
-			do
-				nextarg += parsefmt(ARG_MAX-1,fmt,argc-nextarg,&argv[nextarg]);
-			while ( nextarg>2 && nextarg < argc ); // If nextarg==2 then exit after one pass since that means no arguments were consumed by fmt
-		} else {
+#ifdef HAVE_PLEDGE
+		if (pledge(atfiles ? "stdio rpath" : "stdio", NULL) == -1) {
+			perror("printf: pledge");
+			exit(EXIT_FAILURE);
+		}
+#endif //HAVE_PLEDGE
+
+		if ( badoption )
+			; // Already diagnosed
+		else if ( nfo == 0 ) {
 			usage();
 			anyerrno = EINVAL;
+		} else if ( rangespec != NULL ) {
+			if ( argc > nextarg ) {
+				usage();
+				anyerrno = EINVAL;
+			} else if ( rangeinit(&r,rangespec) == 0 )
+				rangefmt(nfo,fo,&r);
+		} else {
+			int firstarg = nextarg;
+
+			do
+				nextarg += fanoutfmt(nfo,fo,argc-nextarg,&argv[nextarg]);
+			while ( nextarg>firstarg && nextarg < argc ); // If nextarg==firstarg then exit after one pass since that means no arguments were consumed by fmt
 		}
+
+		for ( ; nout > 0; nout-- )
+			if ( fclose(out[nout-1].stream) != 0 ) {
+				anyerrno = errno;
+				diag(DIAG_FILE,"\"%s\": %s",out[nout-1].path,strerror(errno));
+			}
+		free(out);
+		free(fo);
 	} else
 		anyerrno = EFAULT;
 
+	diagsummary();
+
 	if ( anyerrno > 0 )
 #ifdef EX_SOFTWARE
 		if ( anyerrno == EFAULT )
@@ -913,3 +3079,4 @@ main (int argc, char *argv[]) {
 	else
 		return EXIT_SUCCESS;
 }
+#endif // PRINTF_NO_MAIN
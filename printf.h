@@ -0,0 +1,61 @@
+// Interfaces for embedding printf(1) in other programs
+
+#ifndef PRINTF_H
+#define PRINTF_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+/*
+Since printf(3) can't be stopped partway through a conversion, each batch
+of the format (text and at most one conversion) is rendered into memory
+before fmtpull() hands it out.  The argument of a conversion output as is
+rather than by printf(3) (e.g. "%s", "%b", "%J" or "%y", with or without
+a width and precision) isn't copied though but handed out from where it
+is, so only what printf(3) itself renders (e.g. "%d" or "%f") and the
+text around it is ever held beyond the caller's buffer.  Several
+formatters may be open at once, each with its own position, arguments and
+errors.  Diagnostics (still written to stderr) and registered specifiers
+are shared by the whole process.
+*/
+struct fmtstate;
+
+// Formats using fmt and args exactly as printf(1) would, neither of which may change until fmtclose()
+struct fmtstate *fmtopen(size_t fmtlen, char *fmt, int numargs, char *args[]);
+// Copies up to bufsize bytes of output into buf, returning how many or 0 once all output has been pulled
+size_t fmtpull(struct fmtstate *st, char *buf, size_t bufsize);
+// Returns the errno value (e.g. EINVAL for an argument that isn't numeric) of the first error so far or 0 if none
+int fmterror(struct fmtstate *st);
+void fmtclose(struct fmtstate *st);
+
+
+// One conversion specification and its argument as passed to the hooks of its specifier
+struct conversion {
+	FILE *stream;	// Output
+	char *prologue;	// Text before the conversion, already unescaped
+	char *epilogue;	// Text after the conversion, already unescaped
+	size_t fmtlen;
+	char *fmt;	// Flags, width and precision without "%" (e.g. "-8.3"), may be edited by the parse hook
+	char *param;	// Text between the parentheses of "%(...)X" or NULL
+	char specifier[2];	// e.g. "d"
+	char *arg;	// NULL if the arguments have run out
+	// Set by the parse hook for the render hook
+	long long slli;
+	unsigned long long ulli;
+	double d;
+	char *uarg;
+	size_t uarglen;
+	int freeuarg;	// uarg is freed after rendering
+	int abort;	// Stop all output after this conversion (e.g. "\\c" in "%b")
+};
+
+typedef void (*fmthook)(struct conversion *cv);
+
+// Adds (or replaces) a conversion specifier; the render hook outputs cv->prologue, the argument and cv->epilogue to cv->stream
+int fmtregister(int specifier, fmthook parse, fmthook render);
+// Render hook outputting cv->uarg as set by the parse hook (or cv->arg if not) with the flags, width and precision of "%s"
+// With fmtpull(), a uarg not freed by freeuarg must stay valid until the output of its batch has been pulled
+void renderconverted(struct conversion *cv);
+
+#endif // PRINTF_H
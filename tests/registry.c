@@ -0,0 +1,112 @@
+// Checks specifiers registered and unregistered through printf.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "printf.h"
+
+
+int failed = 0;
+
+
+// Pulls the output of fmt (only fmtlen bytes of which are formatted) both 1 byte at a time and as much as fits
+void
+checkn(char *expected, size_t fmtlen, char *fmt, int numargs, char *args[]) {
+
+	struct fmtstate *st;
+	static char out[4096];
+	size_t outlen;
+	size_t n;
+	size_t chunk;
+
+	for ( chunk = 1; chunk < sizeof(out); chunk = sizeof(out)-1 ) {
+		if ( ( st = fmtopen(fmtlen,fmt,numargs,args) ) == NULL ) {
+			fprintf(stderr,"FAIL: fmtopen(\"%.*s\")\n",(int) fmtlen,fmt);
+			failed = 1;
+			return;
+		}
+		outlen = 0;
+		while ( outlen + chunk < sizeof(out) && ( n = fmtpull(st,&out[outlen],chunk) ) > 0 )
+			outlen += n;
+		out[outlen] = '\0';
+		fmtclose(st);
+
+		if ( strcmp(out,expected) != 0 ) {
+			fprintf(stderr,"FAIL: \"%.*s\" pulled %lu at a time gave \"%s\" instead of \"%s\"\n",(int) fmtlen,fmt,(unsigned long) chunk,out,expected);
+			failed = 1;
+		}
+		if ( chunk > 1 )
+			break;
+	}
+}
+
+
+void
+check(char *expected, char *fmt, int numargs, char *args[]) {
+
+	checkn(expected,strlen(fmt),fmt,numargs,args);
+}
+
+
+// "%(ms)K" renders a number of seconds in milliseconds
+void
+parsems(struct conversion *cv) {
+
+	static char buf[32];
+
+	if ( cv->arg != NULL && cv->param != NULL && strcmp(cv->param,"ms") == 0 ) {
+		snprintf(buf,sizeof(buf),"%ld",atol(cv->arg)*1000);
+		cv->uarg = buf;
+	}
+}
+
+
+int
+main(void) {
+
+	char *args[] = {"42","x"};
+	char *secs[] = {"3","3"};
+	char *strs[] = {"ab\\tc","ab\"c","ab"};
+	char *big[] = {NULL};
+	char *expected;
+	char *fmt;
+
+	check("<42>","<%d>",1,args);
+
+	// Only fmtlen bytes of the format are formatted, even without a null after them
+	checkn("ab",2,"ab%d",1,args);
+	fmt = malloc(4);
+	memcpy(fmt,"a%sb",4);
+	checkn("axb",4,fmt,1,&args[1]);
+	free(fmt);
+
+	// Arguments output as is are handed out from where they are, with any width and precision
+	check("[  ab\\tc][ab\tc   ][\"ab\\\"\"][ 6162][ab]","[%7s][%-7b][%.3J][%5y][%.2s]",5,(char *[]) {strs[0],strs[0],strs[1],strs[2],strs[0]});
+	big[0] = malloc(1000+1);
+	memset(big[0],'x',1000); big[0][1000] = '\0';
+	expected = malloc(4096);
+	snprintf(expected,4096,"<%1010s|%-1005s|%.500s>",big[0],big[0],big[0]);
+	check(expected,"<%1010s|%-1005b|%.500s>",3,(char *[]) {big[0],big[0],big[0]});
+	free(expected);
+	free(big[0]);
+	if ( fmtregister('K',parsems,renderconverted) != 0 ) {
+		fprintf(stderr,"FAIL: fmtregister('K')\n");
+		failed = 1;
+	}
+	check("[3000][3]","[%(ms)K][%K]",2,secs);
+
+	// The grouping flag of printf(3) isn't a specifier
+	if ( fmtregister('\'',parsems,renderconverted) == 0 ) {
+		fprintf(stderr,"FAIL: fmtregister('\\'') succeeded\n");
+		failed = 1;
+	}
+	check("<1234>","<%'d>",1,(char *[]) {"1234"});
+
+	// A removed built-in must be truncated rather than reach printf(3) with the argument of another
+	fmtregister('d',NULL,NULL);
+	check("<","<%d>",1,args);
+	check("<42<x","<%d>%s",2,args);
+
+	return failed;
+}
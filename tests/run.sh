@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Regression tests for printf(1) extensions: compares the output of each
+# case (with trailing newlines stripped) against what is expected.
+
+PRINTF=${PRINTF:-./printf}
+failed=0
+
+check() {
+	expected=$1; shift
+	actual=$("$PRINTF" "$@" 2>/dev/null)
+	if [ "$actual" != "$expected" ]; then
+		echo "FAIL: printf $*"
+		echo "	expected: $expected"
+		echo "	actual:   $actual"
+		failed=1
+	fi
+}
+
+# Like check but compares the bytes output as hexadecimal
+checkbytes() {
+	expected=$1; shift
+	actual=$("$PRINTF" "$@" 2>/dev/null | od -An -tx1 | tr -s ' \n' '  ' | sed 's/^ //;s/ $//')
+	if [ "$actual" != "$expected" ]; then
+		echo "FAIL: printf $*"
+		echo "	expected: $expected"
+		echo "	actual:   $actual"
+		failed=1
+	fi
+}
+
+# "q" is a specifier rather than a length modifier so "%qd" is %q followed by "d"
+check "    xd|'a b'd|" '%5qd|%qd|' x 'a b'
+
+# Escaping runs longer than 16 bytes, with bytes needing escapes on either side of 16 byte boundaries
+check '"0123456789abcdef0123456789abcdef\"x\\y\tz"' '%J' '0123456789abcdef0123456789abcdef"x\y	z'
+check '"0123456789abcdef,0123456789abcde""f"' '%V' '0123456789abcdef,0123456789abcde"f'
+check "'0123456789abcdef 0123456789abcd'\\''ef'" '%q' "0123456789abcdef 0123456789abcd'ef"
+check '"0123456789abcdef0123"' '%.20J' '0123456789abcdef0123456789abcdef"'
+
+# "%N" beyond the fields that can be patched is left out rather than passed to strftime(3)
+check '0101010101010101.|' '%(%S%S%S%S%S%S%S%S.%3N|%N)T' 1.5
+
+# A "*" in the strftime(3) format of "%(...)T" is its own rather than a width taking an argument
+TZ=UTC0; export TZ
+check '00:00*|x' '%(%H:%M*)T|%s' 0 x
+check '   00:00|00:   |x' '%*(%H:%M)T|%-*.*(%H:%M)T|%s' 8 0 6 3 0 x
+
+# Only "T" of the built-in specifiers takes a parameter
+check '5|a  ' '%(x)d|%-3(y)s' 5 a
+if "$PRINTF" '%(x)d' 5 >/dev/null 2>&1; then
+	echo "FAIL: printf %(x)d exits without an error"
+	failed=1
+fi
+
+# Fractions of times before the Epoch count back from the second before
+check '23:59:58.500|23:59:59.500|23:59:59.999' '%(%T.%3N)T|%(%T.%3N)T|%(%T.%3N)T' -1.5 -0.5 -0.001
+
+# Like printf(3), "+" and " " only apply to signed conversions
+check '[42][42][][    7][+42][ 42][+2.2]' '[%+u][% u][%+.0u][%+5u][%+d][% i][%+.1f]' 42 42 0 +7 42 42 2.25
+
+# An invalid diagnostic limit is an error rather than no limit
+check '' -l 5x 'x'
+check 'x' -l 5 'x'
+
+# A "%" ending the format is dropped silently and only the "%" of a conversion without a specifier is dropped
+check 'abc' 'abc%'
+if ! "$PRINTF" 'abc%' >/dev/null 2>&1; then
+	echo "FAIL: printf abc% exits with an error"
+	failed=1
+fi
+check 'z
+|x|a5' '%z\n|%z%s|a%5\n' x
+check '|axz' '|a%s%z' x
+
+# Ranges zero fill the digits, not the sign, and an empty range outputs nothing
+check '008,009,010,011,012,' -r 8:12:1:3 '%s,'
+check '-012,-010,-008,' -r -12:-8:2:3 '%s,'
+check '-02,-01,00,01,02,' -r -2:2:1:2 '%s,'
+check '3,2,1,' -r 3:1:-1 '%s,'
+check '8 9 10 ' -r 08:10:1:2 '%d '
+check '' -r 1:0 'x%s'
+
+# Raw integers and IEEE floats, little- and big-endian
+checkbytes '02 01 00 00 01 02 00 00 00 00 00 00 f0 3f 3f 80 00 00' '%w%2W%r%4R' 258 258 1 1
+checkbytes '00 ff 00 00 00' '%1w%.3w' 0 255
+
+# Hexadecimal and base64 encodings, with "#" processing escapes first
+check '61623f|61623F|YWI/Pg==|YWI_Pg|610062|6162' '%y|%Y|%B|%U|%#y|%.2y' 'ab?' 'ab?' 'ab?>' 'ab?>' 'a\0b' 'abc'
+
+tmp=${TMPDIR:-/tmp}/printf-test.$$
+mkdir "$tmp" || exit 1
+
+# The format from a file, and arguments from files with -@
+printf 'x%%s-%%d\n' >"$tmp/fmt"
+check 'xa-1
+xb-2' -f "$tmp/fmt" a 1 b 2
+echo hello >"$tmp/at"
+check '[hello
+][@x][hel]' -@ '[%s][%s][%.3s]' "@$tmp/at" '@@x' "@$tmp/at"
+
+# Several formats over the same arguments, to files named more than once
+check '1
+2' -e '%s\n' -o "$tmp/o1" -e '<%s>' -o "$tmp/o2" -e '%d;' -o "$tmp/./o1" -e '(%s)' 1 2
+for f in "o1:<1>(1)<2>(2)" "o2:1;2;"; do
+	if [ "$(cat "$tmp/${f%%:*}")" != "${f#*:}" ]; then
+		echo "FAIL: -o ${f%%:*}: $(cat "$tmp/${f%%:*}")"
+		failed=1
+	fi
+done
+rm -r "$tmp"
+
+exit $failed